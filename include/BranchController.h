@@ -10,10 +10,15 @@
 // Pin layouts for LEDs will be: 2,14,7,8,6,20,21,5
 
 #define OPEN_PIXEL_PORT 7890
-#define WEBSOCKET_PORT  7891
+#define OPEN_PIXEL_UDP_PORT 7890
+#define SACN_PORT       5568
+#define ARTNET_PORT     6454
+#define DDP_PORT        4048
 
+#define DMX_MAX_UNIVERSES       32
+#define DMX_PIXELS_PER_UNIVERSE 170     // 510 of the 512 DMX channels
+#define WEBSOCKET_PORT  7891
 
-#define BRIGHTNESS 32
 
 #define RED    0xFF0000
 #define GREEN  0x00FF00
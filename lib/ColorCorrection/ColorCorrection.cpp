@@ -0,0 +1,75 @@
+#include <ColorCorrection.h>
+#include <Persist.h>
+#include <Logger.h>
+
+namespace ColorCorrection {
+
+    // Full scale is 255 << 8, not 0xFFFF, so that adding the largest dither
+    // offset to it still rounds down to 255.
+    const float lutFullScale = 255 * 256;
+
+    uint16_t rgLut[3][256];
+
+    bool fDither = false;
+    uint8_t ixFrame = 0;
+    uint16_t ditherOffset = 0x80;               // without dithering we just round
+
+    void load_persistant_data() {
+
+        float gamma = Persist::data.gamma;
+        if (gamma <= 0.0)
+            gamma = 1.0;
+
+        for (int c = 0; c < 3; c++)
+        {
+            float scale = lutFullScale * (Persist::data.brightness / 255.0) * (Persist::data.white_point[c] / 255.0);
+            for (int i = 0; i < 256; i++)
+            {
+                rgLut[c][i] = (uint16_t) ((powf(i / 255.0, gamma) * scale) + 0.5);
+            }
+        }
+
+        fDither = Persist::data.dither;
+        ditherOffset = 0x80;
+
+        LOG_INFO(LED, "color correction: gamma %f brightness %d white %d,%d,%d dither %d",
+                      gamma, Persist::data.brightness,
+                      Persist::data.white_point[0], Persist::data.white_point[1], Persist::data.white_point[2],
+                      fDither);
+    }
+
+    void encode(uint8_t *pbDst, const uint8_t *pbSrc, size_t cPixels) {
+
+        const uint16_t *pRed = rgLut[0];
+        const uint16_t *pGreen = rgLut[1];
+        const uint16_t *pBlue = rgLut[2];
+        const uint16_t offset = ditherOffset;
+
+        while (cPixels--)
+        {
+            *pbDst++ = (pRed[*pbSrc++] + offset) >> 8;
+            *pbDst++ = (pGreen[*pbSrc++] + offset) >> 8;
+            *pbDst++ = (pBlue[*pbSrc++] + offset) >> 8;
+        }
+    }
+
+    void nextFrame() {
+
+        if (!fDither)
+            return;
+
+        // Bit-reversing a counter visits 0, 128, 64, 192, 32... which
+        // spreads the offsets evenly over any short run of frames.
+        ixFrame++;
+        uint8_t b = ixFrame;
+        b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+        b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+        b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+        ditherOffset = b;
+    }
+
+    bool dithering() {
+        return fDither;
+    }
+
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+// Color correction applied to every frame on its way to the strips:
+// gamma, brightness and white point, all folded into one lookup table per
+// color channel.
+//
+// The tables are 16 bits wide. The low 8 bits are what we lose when
+// going to the 8 bit strips, so if dithering is on we add a different
+// offset each frame (the same idea as FastLED's temporal dithering) and
+// the average over a few frames comes out right. That needs frames to keep
+// coming, so LED refreshes the last frame whenever the DMA engine is idle.
+//
+
+#include <Arduino.h>
+
+namespace ColorCorrection {
+
+    void load_persistant_data();
+
+    // Converts cPixels RGB pixels from pbSrc to pbDst. Table lookups only.
+    void encode(uint8_t *pbDst, const uint8_t *pbSrc, size_t cPixels);
+
+    // Moves on to the next dither offset; call once per frame sent
+    void nextFrame();
+
+    bool dithering();
+
+}
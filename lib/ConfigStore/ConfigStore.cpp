@@ -0,0 +1,267 @@
+#include <ConfigStore.h>
+#include <Logger.h>
+
+extern "C"
+{
+#include <FlashTxx.h>
+}
+
+namespace ConfigStore {
+
+    const uint32_t cbSector = FLASH_SECTOR_SIZE;
+    const uint32_t cbPage = 256;                // a flash write can't cross a page
+    const uint32_t addrStore = FLASH_BASE_ADDR + FLASH_SIZE - FLASH_RESERVE;
+
+    const uint32_t magic = 0x314A4362;          // "bCJ1"
+    const uint16_t version = 1;                 // of the record format, not of the values in it
+
+    const uint16_t tagCommit = 0x0000;
+    const uint16_t tagErased = 0xFFFF;
+
+    struct header_t {
+        uint32_t magic;
+        uint32_t sequence;
+        uint16_t version;
+        uint16_t reserved;
+        uint32_t crc;                           // of the fields above
+    };
+
+    struct record_t {
+        uint16_t tag;
+        uint16_t cb;
+        uint32_t crc;                           // of tag, cb and the data
+    };
+
+    int ixSector = -1;                          // the sector being appended to, -1: none
+    int ixCommitted = -1;                       // the newest sector with a committed snapshot, -1: none
+    uint32_t sequence = 0;
+    uint32_t ixWrite = 0;                       // where the next record goes in it
+
+    uint32_t crc32(uint32_t crc, const void *pv, size_t cb) {
+
+        static const uint32_t rgNibble[16] = {
+            0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+            0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+        };
+
+        const uint8_t *pb = (const uint8_t *)pv;
+        crc = ~crc;
+        while (cb--)
+        {
+            crc = rgNibble[(crc ^ *pb) & 0x0F] ^ (crc >> 4);
+            crc = rgNibble[(crc ^ (*pb >> 4)) & 0x0F] ^ (crc >> 4);
+            pb++;
+        }
+        return ~crc;
+    }
+
+    uint32_t record_crc(const record_t &record, const void *pv) {
+
+        uint32_t crc = crc32(0, &record, offsetof(record_t, crc));
+        return crc32(crc, pv, record.cb);
+    }
+
+    uint32_t padded(uint32_t cb) {
+
+        return (cb + 3) & ~3;
+    }
+
+    const uint8_t *sector_address(int ix) {
+
+        return (const uint8_t *)(uintptr_t)(addrStore + ix * cbSector);
+    }
+
+    // Writes and verifies, splitting the write at page boundaries
+    bool flash_write(const uint8_t *pbFlash, const void *pv, uint32_t cb) {
+
+        const uint8_t *pb = (const uint8_t *)pv;
+
+        for (uint32_t ib = 0; ib < cb; )
+        {
+            uintptr_t addr = (uintptr_t)(pbFlash + ib);
+            uint32_t cbChunk = min(cb - ib, cbPage - (addr % cbPage));
+            eepromemu_flash_write((void *)addr, pb + ib, cbChunk);
+            ib += cbChunk;
+        }
+
+        arm_dcache_delete((void *)pbFlash, cb);
+        return memcmp(pbFlash, pv, cb) == 0;
+    }
+
+    bool header_valid(int ix, uint32_t &seq) {
+
+        const header_t *pheader = (const header_t *)sector_address(ix);
+        if (pheader->magic != magic || pheader->version != version ||
+            pheader->crc != crc32(0, pheader, offsetof(header_t, crc)))
+            return false;
+
+        seq = pheader->sequence;
+        return true;
+    }
+
+    // Walks the records of a sector, calling pfn (if any) for each value.
+    // Returns where the valid records end, and whether there was a commit.
+    uint32_t scan(int ix, bool &fCommitted, RecordCallback pfn) {
+
+        const uint8_t *pbSector = sector_address(ix);
+        uint32_t ib = sizeof(header_t);
+        fCommitted = false;
+
+        while (ib + sizeof(record_t) <= cbSector)
+        {
+            const record_t *precord = (const record_t *)(pbSector + ib);
+            const uint8_t *pbData = pbSector + ib + sizeof(record_t);
+
+            if (precord->tag == tagErased ||
+                ib + sizeof(record_t) + padded(precord->cb) > cbSector ||
+                precord->crc != record_crc(*precord, pbData))
+                break;
+
+            if (precord->tag == tagCommit)
+                fCommitted = true;
+            else if (pfn)
+                pfn(precord->tag, pbData, precord->cb);
+
+            ib += sizeof(record_t) + padded(precord->cb);
+        }
+
+        return ib;
+    }
+
+    // True if everything from ib to the end of the sector is erased
+    bool erased_from(int ix, uint32_t ib) {
+
+        const uint32_t *pw = (const uint32_t *)(sector_address(ix) + ib);
+        for (; ib < cbSector; ib += 4)
+        {
+            if (*pw++ != 0xFFFFFFFF)
+                return false;
+        }
+        return true;
+    }
+
+    bool load(RecordCallback pfn) {
+
+        ixSector = -1;
+        ixCommitted = -1;
+
+        // newest first
+        bool rgfTried[cSectors] = {};
+        for (int cTried = 0; cTried < cSectors; cTried++)
+        {
+            int ixNewest = -1;
+            uint32_t seqNewest = 0;
+            for (int ix = 0; ix < cSectors; ix++)
+            {
+                uint32_t seq;
+                if (!rgfTried[ix] && header_valid(ix, seq) && (ixNewest < 0 || (int32_t)(seq - seqNewest) > 0))
+                {
+                    ixNewest = ix;
+                    seqNewest = seq;
+                }
+            }
+
+            if (ixNewest < 0)
+                break;
+
+            rgfTried[ixNewest] = true;
+
+            bool fCommitted;
+            uint32_t ibEnd = scan(ixNewest, fCommitted, NULL);
+            if (!fCommitted)
+            {
+                LOG_WARN(PERSIST, "config sector %d has no committed snapshot, skipping it", ixNewest);
+                continue;
+            }
+
+            scan(ixNewest, fCommitted, pfn);
+
+            ixSector = ixNewest;
+            ixCommitted = ixNewest;
+            sequence = seqNewest;
+
+            // a torn record at the end means nothing more can go in this sector
+            ixWrite = erased_from(ixNewest, ibEnd) ? ibEnd : cbSector;
+
+            LOG_INFO(PERSIST, "config loaded from sector %d (sequence %lu), %lu bytes used", ixSector, sequence, ibEnd);
+            return true;
+        }
+
+        return false;
+    }
+
+    bool append(uint16_t tag, const void *pv, uint16_t cb) {
+
+        if (ixSector < 0 || cb > cbValueMax)
+            return false;
+
+        uint32_t cbRecord = sizeof(record_t) + padded(cb);
+        if (ixWrite + cbRecord > cbSector)
+            return false;
+
+        uint8_t rgb[sizeof(record_t) + cbValueMax + 3];
+        record_t *precord = (record_t *)rgb;
+        precord->tag = tag;
+        precord->cb = cb;
+        if (cb > 0)
+            memcpy(rgb + sizeof(record_t), pv, cb);
+        memset(rgb + sizeof(record_t) + cb, 0xFF, padded(cb) - cb);
+        precord->crc = record_crc(*precord, rgb + sizeof(record_t));
+
+        const uint8_t *pbFlash = sector_address(ixSector) + ixWrite;
+        ixWrite += cbRecord;
+
+        if (!flash_write(pbFlash, rgb, cbRecord))
+        {
+            // whatever is there now fails its CRC; move on to the next sector
+            LOG_ERROR(PERSIST, "config write failed in sector %d", ixSector);
+            ixWrite = cbSector;
+            return false;
+        }
+        return true;
+    }
+
+    bool begin_snapshot() {
+
+        // The last committed snapshot is only given up once a new one has
+        // been committed, so it's never the one we erase, even when earlier
+        // attempts have failed and we've come all the way round.
+        int ix = ixSector < 0 ? 0 : (ixSector + 1) % cSectors;
+        if (ix == ixCommitted)
+            ix = (ix + 1) % cSectors;
+        const uint8_t *pbSector = sector_address(ix);
+
+        LOG_DEBUG(PERSIST, "starting config sector %d", ix);
+        eepromemu_flash_erase_sector((void *)pbSector);
+        arm_dcache_delete((void *)pbSector, cbSector);
+
+        header_t header;
+        header.magic = magic;
+        header.sequence = sequence + 1;
+        header.version = version;
+        header.reserved = 0xFFFF;
+        header.crc = crc32(0, &header, offsetof(header_t, crc));
+
+        ixSector = ix;
+        sequence = header.sequence;
+        ixWrite = sizeof(header_t);
+
+        if (!flash_write(pbSector, &header, sizeof(header)))
+        {
+            LOG_ERROR(PERSIST, "can't write config sector %d", ix);
+            ixWrite = cbSector;
+            return false;
+        }
+        return true;
+    }
+
+    bool commit() {
+
+        if (!append(tagCommit, NULL, 0))
+            return false;
+
+        ixCommitted = ixSector;
+        return true;
+    }
+
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+// An append-only, CRC-checked record store in raw program flash
+//
+// The store is cSectors flash sectors just below the EEPROM emulation area
+// (FLASH_RESERVE in FlashTxx.h keeps OTA updates out of them), used as a
+// ring. Each sector starts with a header holding a sequence number, then a
+// snapshot of every value, then a commit record, then single-value records
+// appended as values change:
+//
+//      header | snapshot records ... | commit | records ...
+//
+// A record is a 16-bit tag, a 16-bit length and a CRC32 of both plus the
+// data, padded to 4 bytes. The newest value of a tag is the last record
+// with that tag.
+//
+// When a sector fills up, the next one in the ring is erased and starts
+// with a new snapshot. Only a sector whose snapshot has been committed is
+// ever read back, so if we lose power in the middle of one the previous
+// sector is still there. A record that was torn by a power failure fails
+// its CRC and ends the sector. Rotating through the sectors spreads the
+// erases over all of them.
+//
+// Appending a record is one short flash write. Starting a new sector
+// erases one, which takes tens of milliseconds, once every few hundred
+// changes.
+//
+
+#include <Arduino.h>
+
+namespace ConfigStore {
+
+    const int cSectors = 8;
+    const uint16_t cbValueMax = 256;
+
+    typedef void (*RecordCallback)(uint16_t tag, const uint8_t *pb, uint16_t cb);
+
+    // Finds the newest committed sector and replays its records in order,
+    // returns false if there isn't one
+    bool load(RecordCallback pfn);
+
+    // Appends a record to the current sector, returns false if it doesn't
+    // fit, in which case the caller should write a new snapshot
+    bool append(uint16_t tag, const void *pv, uint16_t cb);
+
+    // A snapshot is begin_snapshot(), append() for every value, then commit().
+    // begin_snapshot() returns false if the next sector can't be used; calling
+    // it again tries the one after, skipping the last committed snapshot.
+    bool begin_snapshot();
+    bool commit();
+
+}
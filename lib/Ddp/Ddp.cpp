@@ -0,0 +1,99 @@
+#include <Ddp.h>
+#include <BranchController.h>
+#include <LED.h>
+#include <Logger.h>
+
+using namespace qindesign::network;
+
+namespace Ddp {
+
+    const uint32_t tmClientTimeout = 2000;      // ms without a packet before we give up on the sender
+
+    // header flags
+    const uint8_t DDP_FLAGS_VER_MASK = 0xC0;
+    const uint8_t DDP_FLAGS_VER1 = 0x40;
+    const uint8_t DDP_FLAGS_TIMECODE = 0x10;
+    const uint8_t DDP_FLAGS_QUERY = 0x02;
+    const uint8_t DDP_FLAGS_PUSH = 0x01;
+
+    // destination IDs we treat as "the pixels"
+    const uint8_t DDP_ID_DISPLAY = 1;
+    const uint8_t DDP_ID_ALL = 255;
+
+    const size_t cbHeader = 10;                 // 14 with a timecode
+    const size_t cbFrame = 3 * NUM_STRIPS * LEDS_PER_STRIP;
+
+    // A whole frame is about 10 packets, all of which have to wait in the
+    // socket until loop() gets to them
+    const size_t cUdpQueue = 16;
+
+    EthernetUDP udp(cUdpQueue);
+    bool fActive = false;
+    uint32_t tmLastPacket = 0;
+
+    void setup() {
+
+        udp.begin(DDP_PORT);
+        fActive = false;
+        LOG_INFO(NET, "DDP ready");
+    }
+
+    void loop() {
+
+        int cbPacket;
+        for (size_t i = 0; i < cUdpQueue && (cbPacket = udp.parsePacket()) > 0; i++)
+            read_packet(cbPacket);
+
+        if (fActive && (millis() - tmLastPacket) > tmClientTimeout)
+        {
+            LOG_INFO(NET, "DDP sender timed out");
+            LED::openPixelClientConnection(false);
+            fActive = false;
+        }
+    }
+
+    void read_packet(int cbPacket) {
+
+        uint8_t rgHeader[cbHeader + 4];
+        if (cbPacket < (int) cbHeader || udp.read(rgHeader, cbHeader) != (int) cbHeader)
+            return;
+
+        uint8_t flags = rgHeader[0];
+        uint8_t id = rgHeader[3];
+        uint32_t ixOffset = (rgHeader[4] << 24) | (rgHeader[5] << 16) | (rgHeader[6] << 8) | rgHeader[7];
+        uint16_t cbData = (rgHeader[8] << 8) | rgHeader[9];
+
+        if ((flags & DDP_FLAGS_VER_MASK) != DDP_FLAGS_VER1 || (flags & DDP_FLAGS_QUERY))
+            return;
+
+        if (id != DDP_ID_DISPLAY && id != DDP_ID_ALL)
+            return;
+
+        if (flags & DDP_FLAGS_TIMECODE)
+        {
+            // we don't schedule frames, so the timecode is skipped
+            if (udp.read(rgHeader + cbHeader, 4) != 4)
+                return;
+        }
+
+        if (!fActive)
+        {
+            LOG_INFO(NET, "DDP sender connected");
+            LED::openPixelClientConnection(true);
+            fActive = true;
+        }
+        tmLastPacket = millis();
+
+        // The payload goes straight into the back buffer at its offset
+        if (ixOffset < cbFrame)
+        {
+            size_t cbToRead = min((size_t) cbData, cbFrame - ixOffset);
+            udp.read(LED::stripBuffer(0) + ixOffset, cbToRead);
+            LED::pixelsReceived(ixOffset, cbToRead);
+        }
+
+        if (flags & DDP_FLAGS_PUSH)
+            LED::show();
+    }
+
+}
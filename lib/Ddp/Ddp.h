@@ -0,0 +1,23 @@
+#pragma once
+#include <Arduino.h>
+#include <QNEthernet.h>
+
+// implements the receiving side of the Distributed Display Protocol
+// See http://www.3waylabs.com/ddp/
+//
+// Note:
+//
+//      The DDP byte offset is an offset into the whole frame: all
+//      strips, one after the other, 3 bytes per pixel. A frame may be
+//      split across any number of packets and is shown when a packet
+//      with the PUSH flag arrives.
+//
+
+
+namespace Ddp {
+
+    void setup();
+    void loop();
+    void read_packet(int cbPacket);
+
+}
@@ -0,0 +1,264 @@
+#include <Dmx.h>
+#include <BranchController.h>
+#include <Persist.h>
+#include <LED.h>
+#include <Logger.h>
+
+using namespace qindesign::network;
+
+// implements the data and synchronization packets of
+//
+//      ANSI E1.31-2018 (Streaming ACN)
+//      Art-Net 4 (ArtDmx and ArtSync)
+//
+// Everything else (discovery, ArtPoll, RDM...) is ignored.
+
+namespace Dmx {
+
+    const uint32_t tmClientTimeout = 2000;      // ms without data before we give up on the sender
+    const uint32_t tmArtSyncTimeout = 4000;     // Art-Net: back to unsynchronized output 4s after the last ArtSync
+
+    // A frame is a burst of one packet per universe, all of which have to
+    // wait in the socket until loop() gets to them
+    const size_t cUdpQueue = DMX_MAX_UNIVERSES;
+
+    EthernetUDP sacn(cUdpQueue);
+    EthernetUDP artnet(cUdpQueue);
+
+    bool fActive = false;                       // true while a sender is driving the LEDs
+    uint32_t tmLastPacket = 0;
+    uint32_t tmLastArtSync = 0;                 // 0: Art-Net sender has never synchronized
+    uint16_t sacnSyncUniverse = 0;              // 0: sACN sender is not synchronizing
+
+    // One bit per entry in Persist::data.dmx_map
+    uint32_t maskMapped = 0;                    // entries that are in use
+    uint32_t maskReceived = 0;                  // entries received since the last show()
+
+    uint16_t rgJoined[DMX_MAX_UNIVERSES];       // multicast groups we are a member of
+    uint8_t rgSequence[DMX_MAX_UNIVERSES];      // last sequence number per entry
+
+    // sACN header, up to and including the DMX start code
+    const size_t cbSacnHeader = 126;
+    const size_t cbSacnSync = 49;
+    const uint8_t rgSacnId[12] = {'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0};
+    const uint32_t VECTOR_ROOT_E131_DATA = 0x00000004;
+    const uint32_t VECTOR_ROOT_E131_EXTENDED = 0x00000008;
+    const uint32_t VECTOR_E131_DATA_PACKET = 0x00000002;
+    const uint32_t VECTOR_E131_EXTENDED_SYNCHRONIZATION = 0x00000001;
+
+    // Art-Net header, up to and including the data length
+    const size_t cbArtNetHeader = 18;
+    const uint8_t rgArtNetId[8] = {'A', 'r', 't', '-', 'N', 'e', 't', 0};
+    const uint16_t OpDmx = 0x5000;
+    const uint16_t OpSync = 0x5200;
+
+    uint8_t rgPacket[cbSacnHeader];
+
+    uint16_t be16(const uint8_t *pb) { return (pb[0] << 8) | pb[1]; }
+    uint32_t be32(const uint8_t *pb) { return (pb[0] << 24) | (pb[1] << 16) | (pb[2] << 8) | pb[3]; }
+
+    IPAddress multicast_address(uint16_t universe) {
+        return IPAddress(239, 255, universe >> 8, universe & 0xFF);
+    }
+
+    int find_universe(uint16_t universe) {
+
+        for (int i = 0; i < DMX_MAX_UNIVERSES; i++)
+        {
+            if ((maskMapped >> i) & 1 && Persist::data.dmx_map[i].universe == universe)
+                return i;
+        }
+        return -1;
+    }
+
+    void setup() {
+
+        sacn.begin(SACN_PORT);
+        artnet.begin(ARTNET_PORT);
+        memset(rgJoined, 0, sizeof(rgJoined));
+        load_persistant_data();
+        LOG_INFO(NET, "sACN and Art-Net ready");
+    }
+
+    void load_persistant_data() {
+
+        maskMapped = 0;
+        maskReceived = 0;
+
+        for (int i = 0; i < DMX_MAX_UNIVERSES; i++)
+        {
+            const Persist::dmx_universe_t &map = Persist::data.dmx_map[i];
+
+            if (rgJoined[i] != 0 && rgJoined[i] != map.universe)
+            {
+                Ethernet.leaveGroup(multicast_address(rgJoined[i]));
+                rgJoined[i] = 0;
+            }
+
+            if (map.universe == 0 || map.strip >= NUM_STRIPS || map.pixel >= LEDS_PER_STRIP)
+                continue;
+
+            // sACN is usually multicast, one group per universe
+            if (rgJoined[i] != map.universe)
+            {
+                Ethernet.joinGroup(multicast_address(map.universe));
+                rgJoined[i] = map.universe;
+            }
+
+            maskMapped |= (1 << i);
+            rgSequence[i] = 0;
+        }
+    }
+
+    // Called when a sender starts or stops driving the LEDs
+    void activity(bool f) {
+
+        if (f)
+            tmLastPacket = millis();
+
+        if (f == fActive)
+            return;
+
+        LOG_INFO(NET, "DMX sender %s", f ? "connected" : "timed out");
+        LED::openPixelClientConnection(f);
+        fActive = f;
+        maskReceived = 0;
+        sacnSyncUniverse = 0;
+        tmLastArtSync = 0;
+    }
+
+    // The same rule E1.31 uses: anything within 20 behind the last sequence
+    // number is out of order. Sequence number 0 means Art-Net isn't counting.
+    bool out_of_order(int ix, uint8_t sequence) {
+
+        int8_t diff = (int8_t) (sequence - rgSequence[ix]);
+        if (fActive && sequence != 0 && diff <= 0 && diff > -20)
+            return true;
+
+        rgSequence[ix] = sequence;
+        return false;
+    }
+
+    void show_frame() {
+
+        if (maskReceived == 0)
+            return;
+
+        LED::show();
+        maskReceived = 0;
+    }
+
+    // Reads the channel data of one universe straight into the back buffer
+    void receive_universe(EthernetUDP &udp, int ix, size_t cbData, bool fSynchronized) {
+
+        if (!fSynchronized && ((maskReceived >> ix) & 1))
+        {
+            // The sender has moved on to the next frame before we've seen all
+            // of this one. Show what we have rather than fall behind.
+            show_frame();
+        }
+
+        const Persist::dmx_universe_t &map = Persist::data.dmx_map[ix];
+        uint32_t ixByte = 3 * ((map.strip * LEDS_PER_STRIP) + map.pixel);
+
+        // Only whole pixels: the last 2 of 512 channels would land on the
+        // first pixel of the next universe
+        size_t cb = min(cbData, (size_t) (3 * DMX_PIXELS_PER_UNIVERSE));
+        cb = min(cb, (3 * NUM_STRIPS * LEDS_PER_STRIP) - ixByte);
+
+        udp.read(LED::stripBuffer(0) + ixByte, cb);
+        LED::pixelsReceived(ixByte, cb);
+        maskReceived |= (1 << ix);
+
+        if (!fSynchronized && maskReceived == maskMapped)
+            show_frame();
+    }
+
+    void read_sacn(int cbPacket) {
+
+        size_t cbHeader = sacn.read(rgPacket, min((size_t) cbPacket, cbSacnHeader));
+        if (cbHeader < cbSacnSync || memcmp(rgPacket + 4, rgSacnId, sizeof(rgSacnId)) != 0)
+            return;
+
+        uint32_t vectorRoot = be32(rgPacket + 18);
+        uint32_t vectorFraming = be32(rgPacket + 40);
+
+        if (vectorRoot == VECTOR_ROOT_E131_EXTENDED && vectorFraming == VECTOR_E131_EXTENDED_SYNCHRONIZATION)
+        {
+            if (fActive && sacnSyncUniverse != 0 && be16(rgPacket + 45) == sacnSyncUniverse)
+                show_frame();
+            return;
+        }
+
+        if (vectorRoot != VECTOR_ROOT_E131_DATA || vectorFraming != VECTOR_E131_DATA_PACKET || cbHeader < cbSacnHeader)
+            return;
+
+        uint8_t options = rgPacket[112];
+        if (options & 0xC0)                     // preview data, or the stream is being terminated
+            return;
+
+        if (rgPacket[125] != 0)                 // only the null start code carries dimmer data
+            return;
+
+        int ix = find_universe(be16(rgPacket + 113));
+        if (ix < 0 || out_of_order(ix, rgPacket[111]))
+            return;
+
+        activity(true);
+        sacnSyncUniverse = be16(rgPacket + 109);
+
+        size_t cbData = be16(rgPacket + 123);   // property value count includes the start code
+        cbData = cbData > 0 ? min(cbData - 1, (size_t) 512) : 0;
+
+        receive_universe(sacn, ix, cbData, sacnSyncUniverse != 0);
+    }
+
+    void read_artnet(int cbPacket) {
+
+        size_t cbHeader = artnet.read(rgPacket, min((size_t) cbPacket, cbArtNetHeader));
+        if (cbHeader < 10 || memcmp(rgPacket, rgArtNetId, sizeof(rgArtNetId)) != 0)
+            return;
+
+        uint16_t opcode = rgPacket[8] | (rgPacket[9] << 8);     // the one little-endian field
+
+        if (opcode == OpSync)
+        {
+            if (fActive)
+            {
+                tmLastArtSync = millis();
+                show_frame();
+            }
+            return;
+        }
+
+        if (opcode != OpDmx || cbHeader < cbArtNetHeader)
+            return;
+
+        uint16_t portAddress = ((rgPacket[15] & 0x7F) << 8) | rgPacket[14];
+        int ix = find_universe(portAddress + 1);
+        if (ix < 0 || out_of_order(ix, rgPacket[12]))
+            return;
+
+        activity(true);
+
+        bool fSynchronized = tmLastArtSync != 0 && (millis() - tmLastArtSync) < tmArtSyncTimeout;
+        size_t cbData = min((size_t) be16(rgPacket + 16), (size_t) 512);
+
+        receive_universe(artnet, ix, cbData, fSynchronized);
+    }
+
+    void loop() {
+
+        int cbPacket;
+
+        for (size_t i = 0; i < cUdpQueue && (cbPacket = sacn.parsePacket()) > 0; i++)
+            read_sacn(cbPacket);
+
+        for (size_t i = 0; i < cUdpQueue && (cbPacket = artnet.parsePacket()) > 0; i++)
+            read_artnet(cbPacket);
+
+        if (fActive && (millis() - tmLastPacket) > tmClientTimeout)
+            activity(false);
+    }
+
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <Arduino.h>
+#include <QNEthernet.h>
+
+// Receives DMX512 over Ethernet -- E1.31 (sACN) on SACN_PORT and Art-Net on
+// ARTNET_PORT -- and maps the universes onto the strips according to
+// Persist::data.dmx_map.
+//
+// Note:
+//
+//      sACN universe N is the same as Art-Net port address N-1, which is
+//      what most desks and media servers assume.
+//
+//      If the sender synchronizes (an sACN sync address or Art-Net ArtSync
+//      packets) the frame is shown on the sync packet. Otherwise it is shown
+//      as soon as every mapped universe has arrived.
+//
+
+
+namespace Dmx {
+
+    void setup();
+    void loop();
+    void load_persistant_data();
+
+}
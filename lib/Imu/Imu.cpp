@@ -11,23 +11,104 @@
 namespace Imu
 {
     Adafruit_BNO055 bno = Adafruit_BNO055(55);
-    uint32_t timestamp = 0;
-    float orientation_x = 0.0;
-    float orientation_y = 0.0;
-    float orientation_z = 0.0;
-    float head_orientation = 0.0;
-    uint8_t calibration_sys = 0;
-    uint8_t calibration_gyro = 0;
-    uint8_t calibration_accel = 0;
-    uint8_t calibration_mag = 0;
+    bool fPresent = false;
+
+    // We only use the Adafruit driver to bring the sensor up. After that we
+    // read the registers ourselves, in a single burst each, at 400kHz.
+    const uint8_t BNO055_ADDRESS = BNO055_ADDRESS_A;
+    const uint8_t REG_EULER = 0x1A;         // heading, roll, pitch; 16 LSB per degree
+                                            // then quaternion (0x20) and linear acceleration (0x28)
+    const uint8_t cbMotion = 20;
+    const uint8_t REG_CALIB_STAT = 0x35;
+    const uint32_t tmCalibrationPeriod = 1000;
+
+    uint32_t tmLastCalibration = 0;
+
+    // The published sample is guarded by a sequence count, which is odd while
+    // the sample is being written. Readers retry until they see the same even
+    // count before and after their copy.
+    volatile uint32_t seqSample = 0;
+    sample_t published;
+    sample_t sample;                        // being prepared by loop()
+
+    // Only loop() writes the history, and it publishes a record by bumping
+    // seqLatest after the record is complete.
+    record_t rgHistory[cHistory];
+    volatile uint32_t seqLatest = 0;
+
+    void publish()
+    {
+        seqSample++;
+        __sync_synchronize();
+        published = sample;
+        __sync_synchronize();
+        seqSample++;
+    }
+
+    void read(sample_t &copy)
+    {
+        uint32_t seq;
+        do
+        {
+            seq = seqSample;
+            __sync_synchronize();
+            copy = published;
+            __sync_synchronize();
+        } while ((seq & 1) || seq != seqSample);
+    }
+
+    bool read_registers(uint8_t reg, uint8_t *pb, uint8_t cb)
+    {
+        Wire.beginTransmission(BNO055_ADDRESS);
+        Wire.write(reg);
+        if (Wire.endTransmission(false) != 0)
+            return false;
+
+        if (Wire.requestFrom(BNO055_ADDRESS, cb) != cb)
+            return false;
+
+        for (uint8_t i = 0; i < cb; i++)
+            pb[i] = Wire.read();
+
+        return true;
+    }
+
+    uint32_t latest_sequence()
+    {
+        return seqLatest;
+    }
+
+    size_t copy_history(uint32_t seqAfter, record_t *prgRecords, size_t cMax)
+    {
+        uint32_t seqEnd = seqLatest;
+        uint32_t seq = seqAfter + 1;
+
+        if ((int32_t) (seqEnd - seqAfter) <= 0)
+            return 0;
+
+        // skip what has already been overwritten. loop() is the only writer
+        // and never runs while we copy, so every slot holds a whole record.
+        if (seqEnd - seqAfter > cHistory)
+            seq = seqEnd - cHistory + 1;
+
+        size_t cCopied = 0;
+        for (; seq <= seqEnd && cCopied < cMax; seq++)
+        {
+            prgRecords[cCopied++] = rgHistory[seq % cHistory];
+        }
+        return cCopied;
+    }
 
     void setup()
     {
+        memset(&sample, 0, sizeof(sample));
+        publish();
+
         /* Initialise the sensor */
         if (!bno.begin())
         {
             /* There was a problem detecting the BNO055 ... check your connections */
-            Logger.print("Ooops, no BNO055 detected ... Check your wiring or I2C ADDR!");
+            LOG_ERROR(IMU, "Ooops, no BNO055 detected ... Check your wiring or I2C ADDR!");
             return;
         }
 
@@ -35,37 +116,57 @@ namespace Imu
 
         bno.setExtCrystalUse(true);
 
-        timestamp = 0;
-        orientation_x = 0.0;
-        orientation_y = 0.0;
-        orientation_z = 0.0;
-        head_orientation = 0.0;
-        calibration_sys = 0;
-        calibration_gyro = 0;
-        calibration_accel = 0;
-        calibration_mag = 0;
+        // The BNO055 supports fast mode, which cuts our time on the bus by 4
+        Wire.setClock(400000);
+
+        tmLastCalibration = 0;
+        fPresent = true;
     }
 
     void loop()
     {
-        /* Get a Euler angle sample for orientation */
-        imu::Vector<3> orientation;
-        bool success = bno.getVector(Adafruit_BNO055::VECTOR_EULER, &orientation);
-        if (success)
+        if (!fPresent)
+            return;
+
+        /* Get Euler angles, quaternion and linear acceleration in one go */
+        uint8_t rgMotion[cbMotion];
+        if (read_registers(REG_EULER, rgMotion, sizeof(rgMotion)))
         {
-            timestamp = millis();
-            orientation_x = orientation.x();
-            orientation_y = orientation.y();
-            orientation_z = orientation.z();
-            head_orientation = 360.0 - orientation_x - Persist::data.center_orientation;
-            if (head_orientation > 180.0) {
-                head_orientation = head_orientation - 360.0;
+            uint32_t seq = seqLatest + 1;
+            record_t &record = rgHistory[seq % cHistory];
+            record.sequence = seq;
+            record.timestamp = micros();
+            memcpy(record.euler, rgMotion, cbMotion);
+            __sync_synchronize();
+            seqLatest = seq;
+
+            sample.timestamp = millis();
+            sample.orientation_x = record.euler[0] / 16.0;
+            sample.orientation_y = record.euler[1] / 16.0;
+            sample.orientation_z = record.euler[2] / 16.0;
+            sample.head_orientation = 360.0 - sample.orientation_x - Persist::data.center_orientation;
+            if (sample.head_orientation > 180.0) {
+                sample.head_orientation = sample.head_orientation - 360.0;
             }
-            if (head_orientation < -180.0) {
-                head_orientation = head_orientation + 360.0;
+            if (sample.head_orientation < -180.0) {
+                sample.head_orientation = sample.head_orientation + 360.0;
             }
         }
-        bno.getCalibration(&calibration_sys, &calibration_gyro, &calibration_accel, &calibration_mag);
+
+        if ((millis() - tmLastCalibration) >= tmCalibrationPeriod)
+        {
+            uint8_t calibration;
+            if (read_registers(REG_CALIB_STAT, &calibration, 1))
+            {
+                sample.calibration_sys = (calibration >> 6) & 0x03;
+                sample.calibration_gyro = (calibration >> 4) & 0x03;
+                sample.calibration_accel = (calibration >> 2) & 0x03;
+                sample.calibration_mag = calibration & 0x03;
+            }
+            tmLastCalibration = millis();
+        }
+
+        publish();
     }
 
-}
\ No newline at end of file
+}
@@ -6,22 +6,58 @@
 //
 // Implements an interface for Adafruit's BNO055 IMU
 //
+// Imu::loop() is scheduled at the sensor's 100Hz output rate. Each call
+// does one short burst read of the Euler angles, quaternion and linear
+// acceleration; the calibration status
+// only changes slowly and is read once a second. The result is published
+// as a snapshot that readers copy with Imu::read(), which never blocks and
+// never returns a half-written sample.
+//
+// Every sample is also kept, in raw sensor units, in a ring buffer of the
+// last cHistory samples. Records are numbered, so a client that fetches
+// "everything after the last one I saw" never misses one unless it falls
+// more than cHistory samples behind.
+//
 
 namespace Imu
 {
 
+    struct sample_t
+    {
+        uint32_t timestamp;         // millis() when the orientation was read
+        float orientation_x;        // heading, degrees
+        float orientation_y;        // roll, degrees
+        float orientation_z;        // pitch, degrees
+        float head_orientation;     // heading relative to Persist::data.center_orientation, -180 to 180
+        uint8_t calibration_sys;
+        uint8_t calibration_gyro;
+        uint8_t calibration_accel;
+        uint8_t calibration_mag;
+    };
+
+    // One sample as stored in the history and sent to clients, little-endian
+    struct __attribute__((packed)) record_t
+    {
+        uint32_t sequence;          // numbered from 1
+        uint32_t timestamp;         // micros() when read
+        int16_t euler[3];           // heading, roll, pitch; 16 LSB per degree
+        int16_t quaternion[4];      // w, x, y, z; 16384 LSB per unit
+        int16_t linear_accel[3];    // x, y, z; 100 LSB per m/s^2
+    };
+
+    const uint32_t cHistory = 256;
+
     void setup();
     void loop();
 
-    extern uint32_t timestamp;
-    extern float orientation_x;
-    extern float orientation_y;
-    extern float orientation_z;
-    extern float head_orientation;
-    extern uint8_t calibration_sys;
-    extern uint8_t calibration_gyro;
-    extern uint8_t calibration_accel;
-    extern uint8_t calibration_mag;
+    void read(sample_t &sample);
+
+    // Sequence number of the newest record, 0 if there are none yet
+    uint32_t latest_sequence();
+
+    // Copies up to cMax records newer than seqAfter, oldest first. Records
+    // that have already dropped out of the history are skipped.
+    size_t copy_history(uint32_t seqAfter, record_t *prgRecords, size_t cMax);
 }
 
-#endif /* _IMU_H_ */
\ No newline at end of file
+#endif /* _IMU_H_ */
@@ -2,6 +2,9 @@
 #include <Util.h>
 #include <Persist.h>
 #include <Logger.h>
+#include <ColorCorrection.h>
+#include <Stats.h>
+#include <Profiler.h>
 
 namespace LED {
     // Any group of digital pins may be used
@@ -14,21 +17,53 @@ namespace LED {
     // 4 bytes, so divide by 4.  The array is created using "int"
     // so the compiler will align it to 32 bit memory.
     const int bytesPerLED = 3;  // change to 4 if using RGBW
-    DMAMEM int displayMemory[LEDS_PER_STRIP * NUM_STRIPS * bytesPerLED / 4];
-    int drawingMemory[LEDS_PER_STRIP * NUM_STRIPS * bytesPerLED / 4];
+    const int cbFrame = LEDS_PER_STRIP * NUM_STRIPS * bytesPerLED;
+    DMAMEM int displayMemory[cbFrame / 4];
 
     const int config = WS2811_RGB | WS2811_800kHz;
 
-    OctoWS2811 leds(LEDS_PER_STRIP, displayMemory, drawingMemory, config, NUM_STRIPS, pinList);
+    // displayMemory is owned by the DMA engine while a frame is going out,
+    // so we hand it to OctoWS2811 as both its frame and drawing buffer and
+    // only ever write to it ourselves when pleds->busy() is false.
+    //
+    // The strips are only as long as the longest strip a client has actually
+    // sent us (see pixelsReceived()). OctoWS2811 can't change its length, so
+    // like CResizeableOctoWS2811Controller::ChangeSize() we make a new one,
+    // and shorter strips get shown proportionally faster.
+    OctoWS2811 *pleds = NULL;
+    uint16_t cLedsPerStrip = 0;                 // what pleds is currently sending
+    uint16_t cPixelsReceived = 0;               // longest strip received since the client connected
+    bool fTailBlanked = false;                  // true once the LEDs past a shorter length are off
+
+    // Per output configuration, from Persist. Disabled outputs, and the part
+    // of an output past its own length, are never encoded and stay black.
+    uint16_t rgStripLength[NUM_STRIPS];
+    bool rgStripEnabled[NUM_STRIPS];
+    bool fLayoutChanged = true;                 // true if displayMemory needs clearing before the next frame
+
+    //
+    // Frame assembly
+    //
+    // Everything that draws (the protocols, the patterns) writes into the
+    // back buffer. show() marks the frame complete by swapping back and
+    // front; it never waits for the DMA engine. present() copies the front
+    // buffer into displayMemory as soon as the previous frame has finished
+    // going out on the wire.
+    //
+    // If a new frame completes while the previous one is still pending, the
+    // older one is simply replaced: latest frame wins.
+    //
+    int rgFrameBuffers[2][cbFrame / 4];
+    uint8_t *pbBack = (uint8_t *) rgFrameBuffers[0];
+    uint8_t *pbFront = (uint8_t *) rgFrameBuffers[1];
+    bool fFramePending = false;
 
 
     enum Pattern pattern = patternTest;
 
     bool fPowerOn = true;
-    bool fOpenPixelClientConnected = false;
+    int cOpenPixelClients = 0;                  // TCP and UDP clients each count
     int rgbSolidColor;
-    uint32_t tmFrameStart;
-    unsigned int cFrames;
 
     int make_color_rgb(unsigned int red, unsigned int green, unsigned int blue)
     {
@@ -84,27 +119,63 @@ namespace LED {
 
     void setup() {
 
-        tmFrameStart = millis();
-        cFrames = 0;
-        leds.begin();
-
         load_persistant_data();
+        resize(output_length());
     }
 
     void load_persistant_data() {
         pattern = (enum Pattern) Persist::data.pattern;
         rgbSolidColor = Persist::data.rgbSolidColor;
+
+        for (int i = 0; i < NUM_STRIPS; i++)
+        {
+            rgStripLength[i] = min(Persist::data.strip_length[i], (uint16_t) LEDS_PER_STRIP);
+            rgStripEnabled[i] = Persist::data.strip_enabled[i];
+        }
+        fLayoutChanged = true;
+
+        ColorCorrection::load_persistant_data();
+    }
+
+    // How many LEDs per strip we need to send: enough for the longest enabled
+    // strip, but no more than the client is actually sending.
+    uint16_t output_length() {
+
+        uint16_t cPixels = LEDS_PER_STRIP;
+        if (cOpenPixelClients > 0 && cPixelsReceived > 0)
+            cPixels = cPixelsReceived;
+
+        uint16_t cLeds = 1;                     // OctoWS2811 needs at least one
+        for (int i = 0; i < NUM_STRIPS; i++)
+        {
+            if (rgStripEnabled[i])
+                cLeds = max(cLeds, min(rgStripLength[i], cPixels));
+        }
+        return cLeds;
     }
 
     void show_color(int color) {
-        for (int i=0; i < leds.numPixels(); i++) {
-            leds.setPixel(i, color);
+        for (int i = 0; i < NUM_STRIPS; i++) {
+            for (int j = 0; j < LEDS_PER_STRIP; j++) {
+                setPixel(i, j, color);
+            }
         }
-        leds.show();
+        show();
     }
 
     void setPixel(int strip, int led, int rgb) {
-        leds.setPixel((strip*LEDS_PER_STRIP) + led, rgb);
+        uint8_t *pb = stripBuffer(strip) + (led * bytesPerLED);
+        pb[0] = rgb >> 16;
+        pb[1] = rgb >> 8;
+        pb[2] = rgb;
+    }
+
+    uint8_t *stripBuffer(int strip) {
+        // The frame buffers use the same layout as the OctoWS2811 drawing
+        // memory on Teensy 4: a plain array of 3-byte pixels, strip after
+        // strip, already in wire order. With WS2811_RGB that is exactly the
+        // byte order OPC sends, so protocol handlers can read straight into it.
+        return pbBack + (strip * LEDS_PER_STRIP * bytesPerLED);
     }
 
     void setPixel(int strip, int led, uint8_t r, uint8_t g, uint8_t b) {
@@ -113,13 +184,22 @@ namespace LED {
 
     void loop() {
 
+        // Temporal dithering only works if frames keep going out, so while
+        // it is on, an idle DMA engine gets the last frame again.
+        present(ColorCorrection::dithering());
+
+        // Patterns only draw once the previous frame has been handed
+        // to the DMA engine, otherwise they would just be dropped.
+        if (fFramePending)
+            return;
+
         if (!fPowerOn)
         {
             show_color(BLACK);;
             return;
         }
 
-        if (fOpenPixelClientConnected)
+        if (cOpenPixelClients > 0)
         {
             // let the protocol drive the LEDs
             return;
@@ -135,7 +215,7 @@ namespace LED {
 
         static uint8_t hue = 0;
 
-        // Logger.printf("%d\n", hue);
+        LOG_DEBUG(LED, "hue %d", hue);
 
         for(int i = 0; i < NUM_STRIPS; i++) {
             for(int j = 0; j < LEDS_PER_STRIP; j++) {
@@ -153,24 +233,10 @@ namespace LED {
 
         hue++;
 
-        // instead of calling show(), we call delay() which guarantees to call show()
-        // but also gives FastLED a chance to do some temporal dithering.
-        leds.show();
-        CalculateFrameRate();
+        show();
 
     }
 
-    void CalculateFrameRate()
-    {
-        // frame rate calc
-        cFrames++;
-        if (millis() > (tmFrameStart + 1000))
-        {
-            cFrames = 0;
-            tmFrameStart = millis();
-        }
-    }
-
     void setSolidColor(int rgb) {
 
         pattern = patternSolid;
@@ -178,6 +244,7 @@ namespace LED {
 
         Persist::data.pattern = (uint8_t) pattern;
         Persist::data.rgbSolidColor = rgb;
+        Persist::mark_dirty();
 
     }
 
@@ -185,6 +252,7 @@ namespace LED {
 
         pattern = patternTest;
         Persist::data.pattern = (uint8_t) pattern;
+        Persist::mark_dirty();
 
     }
 
@@ -195,14 +263,135 @@ namespace LED {
 
     }
 
+    bool receivingPixels() {
+
+        return cOpenPixelClients > 0;
+
+    }
+
     void openPixelClientConnection(bool f) {
 
-        fOpenPixelClientConnected = f;
+        // a new client gets to decide how long the strips are
+        if (f && cOpenPixelClients == 0)
+            cPixelsReceived = 0;
+
+        cOpenPixelClients += f ? 1 : -1;
+        if (cOpenPixelClients < 0)
+            cOpenPixelClients = 0;
     
     }
 
+    void pixelsReceived(uint32_t ixFirstByte, uint32_t cb) {
+
+        if (cb == 0)
+            return;
+
+        uint32_t ixFirstPixel = ixFirstByte / bytesPerLED;
+        uint32_t ixLastPixel = (ixFirstByte + cb - 1) / bytesPerLED;
+        uint32_t cPixels = LEDS_PER_STRIP;
+
+        // Anything that crosses into the next strip covers a whole strip
+        if (ixFirstPixel / LEDS_PER_STRIP == ixLastPixel / LEDS_PER_STRIP)
+            cPixels = (ixLastPixel % LEDS_PER_STRIP) + 1;
+
+        if (cPixels > cPixelsReceived)
+            cPixelsReceived = cPixels;
+
+        Stats::frameStarted();
+    }
+
+    void resize(uint16_t cLeds) {
+
+        delete pleds;
+        pleds = new OctoWS2811(cLeds, displayMemory, displayMemory, config, NUM_STRIPS, pinList);
+        pleds->begin();
+        cLedsPerStrip = cLeds;
+        fLayoutChanged = true;
+
+        LOG_INFO(LED, "now supporting %d pixels per strip", cLeds);
+    }
+
+    Profiler::Probe probeShow("LED::show");
+    Profiler::Probe probePresent("LED::present");
+
     void show() {
-        leds.show();
+
+        Profiler::Scope scope(probeShow);
+
+        Stats::frameCompleted(fFramePending);
+
+        uint8_t *pb = pbFront;
+        pbFront = pbBack;
+        pbBack = pb;
+        fFramePending = true;
+
+        // OPC clients may update only some of the strips in a frame, so the
+        // new back buffer has to start out as the frame we just completed.
+        memcpy(pbBack, pbFront, cbFrame);
+
+        present();
+    }
+
+    void present(bool fRefresh) {
+
+        // pleds->show() would block until the previous frame is out, so don't
+        // even try until it is.
+        if (!(fFramePending || fRefresh) || pleds->busy())
+            return;
+
+        Profiler::Scope scope(probePresent);
+
+        uint16_t cLeds = output_length();
+
+        if (cLeds != cLedsPerStrip)
+        {
+            if (cLeds < cLedsPerStrip && !fTailBlanked)
+            {
+                // The LEDs past the new end would keep whatever they showed
+                // last, so turn them off first. The frame stays pending.
+                memset(displayMemory, 0, sizeof(displayMemory));
+                pleds->show();
+                fTailBlanked = true;
+                return;
+            }
+
+            resize(cLeds);
+        }
+
+        // Also when the length went back to where it was without a resize:
+        // the next shrink has to blank again
+        if (cLeds == cLedsPerStrip)
+            fTailBlanked = false;
+
+        if (fLayoutChanged)
+        {
+            // clears the disabled strips and the tails of the short ones,
+            // which are then left alone
+            memset(displayMemory, 0, sizeof(displayMemory));
+            fLayoutChanged = false;
+        }
+
+        uint32_t usStart = micros();
+
+        // displayMemory is packed at the current length, the frame buffers
+        // always at LEDS_PER_STRIP. Color correction happens on the way.
+        uint8_t *pbDisplay = (uint8_t *) displayMemory;
+        for (int i = 0; i < NUM_STRIPS; i++)
+        {
+            if (!rgStripEnabled[i])
+                continue;
+
+            ColorCorrection::encode(pbDisplay + (i * cLedsPerStrip * bytesPerLED),
+                                    pbFront + (i * LEDS_PER_STRIP * bytesPerLED),
+                                    min(rgStripLength[i], cLedsPerStrip));
+        }
+
+        uint32_t usEncoded = micros();
+        pleds->show();
+        Stats::frameShown(!fFramePending, usEncoded - usStart, micros() - usEncoded);
+
+        fFramePending = false;
+        ColorCorrection::nextFrame();
     }
 
 
@@ -21,10 +21,26 @@ namespace LED {
     void setSolidColor(int rgb);
     void setPixel(int strip, int led, int rgb);
     void setPixel(int strip, int led, uint8_t r, uint8_t g, uint8_t b);
+
+    // Back buffer for one strip: LEDS_PER_STRIP pixels of 3 bytes, RGB.
+    // The strips are contiguous. Only valid until the next show().
+    uint8_t *stripBuffer(int strip);
+
     void testPattern();
     bool togglePower();
     void openPixelClientConnection(bool f);
-    void CalculateFrameRate();
+    bool receivingPixels();             // a client is connected and sending frames
+
+    // Protocols report which part of the frame they wrote, as a byte offset
+    // and length in the back buffer, so the strips can be sized to the
+    // longest one a client actually drives.
+    void pixelsReceived(uint32_t ixFirstByte, uint32_t cb);
+    uint16_t output_length();
+    void resize(uint16_t cLeds);
+
+    // Marks the frame in the back buffer as complete. Never blocks: the
+    // frame is handed to the DMA engine by present() once it is free.
     void show();
+    void present(bool fRefresh = false);
 
 }
\ No newline at end of file
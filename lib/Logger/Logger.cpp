@@ -1,5 +1,6 @@
 #include "Logger.h"
 #include "Arduino.h"
+#include <Mqtt.h>
 
 MqttLogger::MqttLogger(const char *topic, MqttLoggerMode mode)
 {
@@ -69,52 +70,154 @@ boolean MqttLogger::setBufferSize(uint16_t size)
     return (this->buffer != NULL);
 }
 
-// send & reset current buffer
+// A record is a 4 byte header followed by the data, padded to a multiple
+// of 4 so that headers never wrap around the end of the ring. The header
+// holds the length and a marker that says the record is complete; the ring
+// is zeroed as it's drained, so a header that hasn't been stored yet reads
+// as 0.
+static const uint32_t recordComplete = 0xA5000000;
+
+static inline uint32_t recordSize(uint32_t cb)
+{
+    return (4 + cb + 3) & ~3;
+}
+
+// publish & reset the current line
 void MqttLogger::sendBuffer()
 {
     if (this->bufferCnt > 0)
     {
-        bool doSerial = this->mode == MqttLoggerMode::SerialOnly || this->mode == MqttLoggerMode::MqttAndSerial;
-        if (this->mode != MqttLoggerMode::SerialOnly && this->client != NULL && this->client->connected())
-        {
-            this->client->publish(this->topic, (byte *)this->buffer, this->bufferCnt, 1);
-        }
-        else if (this->mode == MqttLoggerMode::MqttAndSerialFallback)
-        {
-            doSerial = true;
-        }
-        if (doSerial)
-        {
-            Serial.write(this->buffer, this->bufferCnt);
-            Serial.println();
-        }
+        // queued, so that logging never waits for the broker
+        Mqtt::publish(this->topic, this->buffer, this->bufferCnt, true);
         this->bufferCnt = 0;
     }
     this->bufferEnd = this->buffer;
 }
 
-// implement Print::write(uint8_t c): store into a buffer until \n or buffer full
-size_t MqttLogger::write(uint8_t character)
+// copies cb bytes into the ring at ix, wrapping around the end
+void MqttLogger::copyRing(uint32_t ix, const uint8_t *pb, uint32_t cb)
+{
+    uint32_t ixRing = ix & (cbRing - 1);
+    uint32_t cbFirst = min(cb, cbRing - ixRing);
+
+    memcpy(this->ring + ixRing, pb, cbFirst);
+    memcpy(this->ring, pb + cbFirst, cb - cbFirst);
+}
+
+// Sends the data of one record on, returns false if it has to wait
+bool MqttLogger::emit(uint32_t ix, uint32_t cb)
 {
-    if (character == '\n') // when newline is printed we send the buffer
+    bool fMqtt = this->mode != MqttLoggerMode::SerialOnly && this->client != NULL && Mqtt::connected();
+    bool fSerial = this->mode == MqttLoggerMode::SerialOnly || this->mode == MqttLoggerMode::MqttAndSerial ||
+                   (this->mode == MqttLoggerMode::MqttAndSerialFallback && !fMqtt);
+
+    // binary records (LOG_PRINTF) are only for Serial
+    if (this->ring[ix & (cbRing - 1)] == LogArgs::recordMarker)
     {
-        this->sendBuffer();
+        fMqtt = false;
+        fSerial = this->mode != MqttLoggerMode::MqttOnly;
     }
-    else
+
+    // Serial.write() blocks while the host isn't keeping up
+    if (fSerial && Serial && Serial.availableForWrite() < (int)cb)
+        return false;
+
+    for (uint32_t i = 0; i < cb; i++)
     {
-        if (this->bufferCnt < this->bufferSize) // add char to end of buffer
+        uint8_t character = this->ring[(ix + i) & (cbRing - 1)];
+
+        if (fSerial)
+            Serial.write(character);
+
+        if (!fMqtt)
+            continue;
+
+        // MQTT gets a message per line
+        if (character == '\n' || this->bufferCnt >= this->bufferSize)
+            this->sendBuffer();
+
+        if (character != '\n' && character != '\r')
         {
             *(this->bufferEnd++) = character;
             this->bufferCnt++;
         }
-        else // buffer is full, first send&reset buffer and then add char to buffer
+    }
+    return true;
+}
+
+size_t MqttLogger::write(uint8_t character)
+{
+    return this->write(&character, 1);
+}
+
+size_t MqttLogger::write(const uint8_t *pb, size_t size)
+{
+    uint32_t cb = min((uint32_t)size, cbRecordMax);
+    if (cb == 0)
+        return 0;
+
+    // reserve space
+    uint32_t cbRecord = recordSize(cb);
+    uint32_t ix = this->ixHead.load(std::memory_order_relaxed);
+    do
+    {
+        if (ix + cbRecord - this->ixTail.load(std::memory_order_acquire) > cbRing)
         {
-            this->sendBuffer();
-            *(this->bufferEnd++) = character;
-            this->bufferCnt++;
+            this->cDropped.fetch_add(1, std::memory_order_relaxed);
+            return size;
         }
+    } while (!this->ixHead.compare_exchange_weak(ix, ix + cbRecord, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    // fill it, then mark it complete
+    this->copyRing(ix + 4, pb, cb);
+    __atomic_store_n((uint32_t *)(this->ring + (ix & (cbRing - 1))), recordComplete | cb, __ATOMIC_RELEASE);
+    return size;
+}
+
+void MqttLogger::drain(uint32_t usBudget)
+{
+    uint32_t usStart = micros();
+
+    while ((micros() - usStart) < usBudget)
+    {
+        uint32_t ix = this->ixTail.load(std::memory_order_relaxed);
+        uint32_t *pheader = (uint32_t *)(this->ring + (ix & (cbRing - 1)));
+        uint32_t header = __atomic_load_n(pheader, __ATOMIC_ACQUIRE);
+
+        if ((header & 0xFF000000) != recordComplete)
+            return;
+
+        uint32_t cb = header & 0xFFFF;
+        if (!this->emit(ix + 4, cb))
+            return;
+
+        // zero it for the next writer, then hand the space back
+        uint32_t cbRecord = recordSize(cb);
+        uint32_t ixRing = ix & (cbRing - 1);
+        uint32_t cbFirst = min(cbRecord, cbRing - ixRing);
+        memset(this->ring + ixRing, 0, cbFirst);
+        memset(this->ring, 0, cbRecord - cbFirst);
+        this->ixTail.store(ix + cbRecord, std::memory_order_release);
     }
-    return 1;
 }
 
-MqttLogger Logger("log", MqttLoggerMode::SerialOnly);
\ No newline at end of file
+uint32_t MqttLogger::dropped()
+{
+    return this->cDropped.load(std::memory_order_relaxed);
+}
+
+MqttLogger Logger("log", MqttLoggerMode::SerialOnly);
+
+uint8_t rgLogLevel[cLogModules] = {
+    min(LOG_LEVEL, LOG_LEVEL_INFO),
+    min(LOG_LEVEL, LOG_LEVEL_INFO),
+    min(LOG_LEVEL, LOG_LEVEL_INFO),
+    min(LOG_LEVEL, LOG_LEVEL_INFO),
+    min(LOG_LEVEL, LOG_LEVEL_INFO),
+    min(LOG_LEVEL, LOG_LEVEL_INFO),
+    min(LOG_LEVEL, LOG_LEVEL_INFO),
+    min(LOG_LEVEL, LOG_LEVEL_INFO),
+};
+
+const char *rgszLogModules[cLogModules] = {"OPC", "LED", "NET", "IMU", "OTA", "PERSIST", "RELAY", "SYS"};
+const char *rgszLogLevels[LOG_LEVEL_DEBUG + 1] = {"none", "error", "warn", "info", "debug"};
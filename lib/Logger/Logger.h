@@ -4,6 +4,197 @@
 #include <Arduino.h>
 #include <Print.h>
 #include <PubSubClient.h>
+#include <atomic>
+#include <type_traits>
+
+//
+// Deferred formatting
+//
+// With LOG_DEFERRED defined, LOG_PRINTF() doesn't format anything on the
+// device. The format string is placed in flash and its address, which the
+// linker fixes at build time, is used as its ID. What gets logged is a
+// binary record:
+//
+//      0xFF, length of the rest, format address (4 bytes), arguments
+//
+// The record holds at most 128 bytes. If the arguments don't all fit, the
+// ones that do are kept and 0x80 is added to the length.
+//
+// Integers (up to 32 bits), characters and pointers take 4 bytes, 64 bit
+// integers and floating point (as a double) 8, and strings are copied with
+// their terminating zero. Everything is little-endian. Text logging is
+// unchanged and never contains 0xFF, so both can share the Serial stream;
+// tools/logdecode.py turns it back into text using the firmware's ELF file.
+// Records are not sent over MQTT.
+//
+// Each format string gets a section of its own, .progmem.logfmt.<n>. GCC
+// won't put a static of an inline function (which is COMDAT) in the same
+// named section as an ordinary one, and LOG_*() is used in both.
+//
+// Without LOG_DEFERRED, LOG_PRINTF() is simply Logger.printf().
+//
+#ifdef LOG_DEFERRED
+#define LOG_SECTION_NAME_(n) ".progmem.logfmt." #n
+#define LOG_SECTION_NAME(n) LOG_SECTION_NAME_(n)
+#define LOG_PRINTF(format, ...)                                                                         \
+    do                                                                                                  \
+    {                                                                                                   \
+        static const char szFormat_[] __attribute__((section(LOG_SECTION_NAME(__COUNTER__)), used)) = format; \
+        if (false)                                                                                      \
+            log_check_format(format, ##__VA_ARGS__);                                                    \
+        Logger.deferred(szFormat_, ##__VA_ARGS__);                                                      \
+    } while (0)
+#else
+#define LOG_PRINTF(format, ...) Logger.printf(format, ##__VA_ARGS__)
+#endif
+
+//
+// Levels and modules
+//
+//      LOG_ERROR(OPC, "channel %d not supported", channel);
+//
+// Each message has a severity and comes from one of the modules below; the
+// output line is prefixed with both ("E OPC: ...") and ends with a newline.
+//
+// Messages less severe than LOG_LEVEL, set per build in platformio.ini,
+// compile to nothing. The rest are filtered again at run time against the
+// module's entry in rgLogLevel, which can be changed over HTTP at /log. It
+// starts at LOG_LEVEL, but never above info: debug messages have to be
+// asked for.
+//
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+enum LogModule
+{
+    LOG_OPC,
+    LOG_LED,
+    LOG_NET,
+    LOG_IMU,
+    LOG_OTA,
+    LOG_PERSIST,
+    LOG_RELAY,
+    LOG_SYS,                            // startup and the scheduler
+    cLogModules
+};
+
+extern uint8_t rgLogLevel[cLogModules];
+extern const char *rgszLogModules[cLogModules];
+extern const char *rgszLogLevels[LOG_LEVEL_DEBUG + 1];
+
+#define LOG_AT(level, tag, module, format, ...)                                                         \
+    do                                                                                                  \
+    {                                                                                                   \
+        if (rgLogLevel[LOG_##module] >= level)                                                          \
+            LOG_PRINTF(tag " " #module ": " format "\n", ##__VA_ARGS__);                                \
+    } while (0)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(module, format, ...) LOG_AT(LOG_LEVEL_ERROR, "E", module, format, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(module, format, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(module, format, ...) LOG_AT(LOG_LEVEL_WARN, "W", module, format, ##__VA_ARGS__)
+#else
+#define LOG_WARN(module, format, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(module, format, ...) LOG_AT(LOG_LEVEL_INFO, "I", module, format, ##__VA_ARGS__)
+#else
+#define LOG_INFO(module, format, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(module, format, ...) LOG_AT(LOG_LEVEL_DEBUG, "D", module, format, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(module, format, ...) do {} while (0)
+#endif
+
+// Only there so that the compiler checks LOG_PRINTF's arguments
+static inline void log_check_format(const char *, ...) __attribute__((format(printf, 1, 2)));
+static inline void log_check_format(const char *, ...) {}
+
+namespace LogArgs
+{
+    const uint8_t recordMarker = 0xFF;
+    const uint8_t lengthTruncated = 0x80;   // set in the length byte if arguments were left out
+    const size_t cbRecordMax = 128;
+    const size_t cchStringMax = 32;
+
+    struct record_t
+    {
+        uint8_t rgb[cbRecordMax];
+        size_t cb;
+        bool fTruncated;                    // once an argument didn't fit, none of the following ones go in either
+    };
+
+    inline void pack(record_t &record, const void *pv, size_t cbArg)
+    {
+        if (record.fTruncated || record.cb + cbArg > cbRecordMax)
+        {
+            record.fTruncated = true;
+            return;
+        }
+        memcpy(record.rgb + record.cb, pv, cbArg);
+        record.cb += cbArg;
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type pack(record_t &record, T value)
+    {
+        if (sizeof(T) <= 4)
+        {
+            uint32_t u = (uint32_t)value;
+            pack(record, &u, sizeof(u));
+        }
+        else
+        {
+            uint64_t u = (uint64_t)value;
+            pack(record, &u, sizeof(u));
+        }
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_floating_point<T>::value>::type pack(record_t &record, T value)
+    {
+        double d = value;
+        pack(record, &d, sizeof(d));
+    }
+
+    inline void pack(record_t &record, const char *sz)
+    {
+        size_t cch = sz ? strnlen(sz, cchStringMax - 1) : 0;
+        if (record.fTruncated || record.cb + cch + 1 > cbRecordMax)
+        {
+            record.fTruncated = true;
+            return;
+        }
+        memcpy(record.rgb + record.cb, sz, cch);
+        record.rgb[record.cb + cch] = 0;
+        record.cb += cch + 1;
+    }
+
+    inline void pack(record_t &record, char *sz)
+    {
+        pack(record, (const char *)sz);
+    }
+
+    inline void pack(record_t &record, const void *pv)
+    {
+        uint32_t u = (uint32_t)(uintptr_t)pv;
+        pack(record, &u, sizeof(u));
+    }
+}
 
 enum MqttLoggerMode
 {
@@ -13,16 +204,40 @@ enum MqttLoggerMode
     MqttAndSerial = 3,
 };
 
+//
+// Everything written to the Logger goes into a fixed-size ring buffer and
+// is only sent on to Serial and MQTT later, by drain(), which is scheduled
+// as a low priority task and stops when its time budget is used up. So
+// logging costs a copy, wherever it's done.
+//
+// write() may be called from interrupts as well as the loop: space in the
+// ring is reserved with a compare-and-swap, and each write becomes a record
+// whose header is only stored once its data has been copied in. drain()
+// stops at the first record that hasn't been completed yet.
+//
+// If the ring is full the write is dropped and counted, see dropped().
+//
 class MqttLogger : public Print
 {
 private:
+    static const uint32_t cbRing = 4096;            // a power of two
+    static const uint32_t cbRecordMax = 512;        // longer writes are truncated
+
     const char *topic;
     uint8_t *buffer;
     uint8_t *bufferEnd;
     uint16_t bufferCnt = 0, bufferSize = 0;
     PubSubClient *client;
     MqttLoggerMode mode;
+
+    uint8_t ring[cbRing] __attribute__((aligned(4)));
+    std::atomic<uint32_t> ixHead{0};                // free-running: the next byte to reserve
+    std::atomic<uint32_t> ixTail{0};                // free-running: the next byte to drain
+    std::atomic<uint32_t> cDropped{0};
+
     void sendBuffer();
+    void copyRing(uint32_t ix, const uint8_t *pb, uint32_t cb);
+    bool emit(uint32_t ix, uint32_t cb);
 
 public:
     MqttLogger(const char *topic, MqttLoggerMode mode = MqttLoggerMode::MqttAndSerialFallback);
@@ -35,12 +250,35 @@ public:
     void setRetained(boolean retained);
 
     virtual size_t write(uint8_t);
+    virtual size_t write(const uint8_t *buffer, size_t size);
     using Print::write;
 
+    // Logs a binary record, see LOG_PRINTF()
+    template <typename... Args>
+    void deferred(const char *szFormat, Args... args)
+    {
+        LogArgs::record_t record;
+        record.cb = 6;
+        record.fTruncated = false;
+        uint32_t ixFormat = (uint32_t)(uintptr_t)szFormat;
+
+        int rgUnused[] = {0, (LogArgs::pack(record, args), 0)...};
+        (void)rgUnused;
+
+        record.rgb[0] = LogArgs::recordMarker;
+        record.rgb[1] = (record.cb - 2) | (record.fTruncated ? LogArgs::lengthTruncated : 0);
+        memcpy(record.rgb + 2, &ixFormat, sizeof(ixFormat));
+        this->write(record.rgb, record.cb);
+    }
+
+    // Sends what has been logged on to Serial and MQTT, for at most usBudget
+    void drain(uint32_t usBudget = 200);
+    uint32_t dropped();                             // writes lost because the ring was full
+
     uint16_t getBufferSize();
     boolean setBufferSize(uint16_t size);
 };
 
 extern MqttLogger Logger;
 
-#endif
\ No newline at end of file
+#endif
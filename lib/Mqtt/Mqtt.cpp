@@ -3,63 +3,240 @@
 #include <Logger.h>
 #include <QNEthernet.h>
 #include <PubSubClient.h>
+#include <Persist.h>
 
 using namespace qindesign::network;
 
 namespace Mqtt
 {
-    const IPAddress broker(192, 168, 86, 52);
-    int port = 1883;
+    IPAddress broker;                           // from Persist::data, 0.0.0.0 = MQTT off
+    uint16_t port = 0;
+
+    const uint32_t tmReconnectInterval = 5000;  // ms between connection attempts
+    const uint32_t tmReconnectIntervalMax = 60000;  // backed off to while the broker doesn't answer
+    const uint32_t tmConnectTimeout = 3000;     // ms we wait for the TCP connection
+    const uint16_t secSocketTimeout = 1;        // longest PubSubClient may block waiting for the broker
+    const uint32_t usDrainBudget = 500;         // time loop() may spend publishing
 
     EthernetClient net;
     PubSubClient MqttClient(net);
 
-    long lastReconnectAttempt = 0;
+    // Unique per controller, so that the broker doesn't throw one off when
+    // another connects, and so that we can tell their messages apart
+    char szClientId[20];                        // "branch-" and the last 3 bytes of the MAC
+    char szLogTopic[28];
+
+    enum State { disabled,                      // no broker configured
+                 offline,                       // waiting to try again
+                 connecting,                    // TCP connection in progress
+                 online
+               };
+
+    State state = disabled;
+    uint32_t tmStateChange = 0;
+    uint32_t tmRetry = tmReconnectInterval;
+
+    //
+    // Outbound queue
+    //
+    // A fixed ring of messages. When it's full the oldest message is
+    // dropped: for telemetry and logs the newest is the most useful.
+    //
+    struct message_t
+    {
+        const char *szTopic;
+        uint16_t cb;
+        bool fRetained;
+        uint8_t rgb[cbPayloadMax];
+    };
+
+    message_t rgQueue[cQueue];
+    int ixQueueHead = 0;
+    int cQueued = 0;
+    uint32_t cDropped = 0;
 
-    boolean reconnect()
+    bool publish(const char *szTopic, const uint8_t *pb, size_t cb, bool fRetained)
     {
-        Logger.print("Attempting to connect to the MQTT broker: ");
-        Logger.println(broker);
-        if (MqttClient.connect("teensy"))
+        if (cb > cbPayloadMax)
+            return false;
+
+        if (cQueued == cQueue)
         {
-            Logger.println("MPTT connected");
+            ixQueueHead = (ixQueueHead + 1) % cQueue;
+            cQueued--;
+            cDropped++;
         }
-        else
+
+        message_t &message = rgQueue[(ixQueueHead + cQueued) % cQueue];
+        message.szTopic = szTopic;
+        message.cb = cb;
+        message.fRetained = fRetained;
+        memcpy(message.rgb, pb, cb);
+        cQueued++;
+        return true;
+    }
+
+    bool publish(const char *szTopic, const char *sz, bool fRetained)
+    {
+        return publish(szTopic, (const uint8_t *)sz, strlen(sz), fRetained);
+    }
+
+    bool connected()
+    {
+        return state == online;
+    }
+
+    uint32_t dropped()
+    {
+        return cDropped;
+    }
+
+    // Publishes queued messages until the queue is empty, the budget is used
+    // up, or the socket can't take the next one without blocking
+    void drain()
+    {
+        uint32_t usStart = micros();
+
+        while (cQueued > 0 && (micros() - usStart) < usDrainBudget)
         {
-            Logger.print("failed, rc=");
-            Logger.print(MqttClient.state());
-            Logger.println(" trying again in 5 seconds");
+            message_t &message = rgQueue[ixQueueHead];
+
+            // fixed header, topic length and topic, then the payload
+            size_t cbPacket = 5 + 2 + strlen(message.szTopic) + message.cb;
+            if ((size_t)net.availableForWrite() < cbPacket)
+                return;
+
+            MqttClient.publish(message.szTopic, message.rgb, message.cb, message.fRetained);
+            ixQueueHead = (ixQueueHead + 1) % cQueue;
+            cQueued--;
         }
-        return MqttClient.connected();
+    }
+
+    void setState(State stateNew)
+    {
+        state = stateNew;
+        tmStateChange = millis();
+    }
+
+    const char *client_id()
+    {
+        return szClientId;
     }
 
     void setup()
     {
+        uint8_t mac[6];
+        Ethernet.macAddress(mac);
+        snprintf(szClientId, sizeof(szClientId), "branch-%02x%02x%02x", mac[3], mac[4], mac[5]);
+        snprintf(szLogTopic, sizeof(szLogTopic), "%s/log", szClientId);
+
         Logger.setClient(MqttClient);
+        Logger.setTopic(szLogTopic);
+        MqttClient.setSocketTimeout(secSocketTimeout);
+        MqttClient.setBufferSize(cbPayloadMax + 128);
+        load_persistant_data();
+    }
+
+    void load_persistant_data()
+    {
+        const byte *pb = Persist::data.mqtt_broker;
+        IPAddress brokerNew(pb[0], pb[1], pb[2], pb[3]);
+
+        if (state != disabled && brokerNew == broker && Persist::data.mqtt_port == port)
+            return;
+
+        if (state != disabled)
+        {
+            if (state == online)
+                MqttClient.disconnect();
+            net.abort();
+        }
+
+        broker = brokerNew;
+        port = Persist::data.mqtt_port;
+
+        if (broker == IPAddress(0, 0, 0, 0))
+        {
+            setState(disabled);
+            LOG_INFO(NET, "MQTT off, no broker configured");
+            return;
+        }
+
         MqttClient.setServer(broker, port);
-        lastReconnectAttempt = 0;
-        Logger.println("MQTT ready");
+
+        // try straight away
+        state = offline;
+        tmRetry = tmReconnectInterval;
+        tmStateChange = millis() - tmRetry;
+        LOG_INFO(NET, "MQTT ready, broker %u.%u.%u.%u:%u", broker[0], broker[1], broker[2], broker[3], port);
     }
 
+    //
+    // Connecting happens in two steps so that neither one blocks: the TCP
+    // connection is started with connectNoWait() and checked on each pass
+    // through the loop. Once it's up, PubSubClient::connect() only has to
+    // exchange CONNECT/CONNACK.
+    //
+    // That exchange does block: PubSubClient spins until the CONNACK arrives
+    // or secSocketTimeout runs out, and it keeps its connection state to
+    // itself, so we can't do the handshake for it. A broker that accepts the
+    // TCP connection but never answers stalls the loop for secSocketTimeout
+    // on every attempt. To keep that rare, each failed handshake doubles the
+    // time to the next attempt, up to tmReconnectIntervalMax.
+    //
     void loop()
     {
-        if (!MqttClient.connected())
+        uint32_t now = millis();
+
+        switch (state)
         {
-            long now = millis();
-            if (now - lastReconnectAttempt > 5000)
+        case disabled:
+            break;
+
+        case offline:
+            if (now - tmStateChange > tmRetry)
             {
-                lastReconnectAttempt = now;
-                // Attempt to reconnect
-                if (reconnect())
+                LOG_INFO(NET, "Attempting to connect to the MQTT broker: %u.%u.%u.%u", broker[0], broker[1], broker[2], broker[3]);
+                net.connectNoWait(broker, port);
+                setState(connecting);
+            }
+            break;
+
+        case connecting:
+            if (net.connected())
+            {
+                if (MqttClient.connect(szClientId))
+                {
+                    LOG_INFO(NET, "MQTT connected as %s", szClientId);
+                    tmRetry = tmReconnectInterval;
+                    setState(online);
+                }
+                else
                 {
-                    lastReconnectAttempt = 0;
+                    tmRetry = min(2 * tmRetry, tmReconnectIntervalMax);
+                    LOG_WARN(NET, "MQTT failed, rc=%d trying again in %lu seconds", MqttClient.state(), tmRetry / 1000);
+                    net.stop();
+                    setState(offline);
                 }
             }
-        }
-        else
-        {
-            // Client connected
-            MqttClient.loop();
+            else if (now - tmStateChange > tmConnectTimeout)
+            {
+                LOG_WARN(NET, "MQTT broker not reachable, trying again in %lu seconds", tmRetry / 1000);
+                net.abort();
+                setState(offline);
+            }
+            break;
+
+        case online:
+            if (!MqttClient.loop())
+            {
+                LOG_WARN(NET, "MQTT connection lost");
+                net.stop();
+                setState(offline);
+                break;
+            }
+            drain();
+            break;
         }
     }
-}
\ No newline at end of file
+}
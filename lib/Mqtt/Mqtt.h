@@ -7,46 +7,105 @@
 //
 // Implements an interface for MQTT
 //
+// Nothing here blocks the main loop for long, whatever state the broker is
+// in: connecting is a state machine driven by Mqtt::loop() (but see the
+// CONNACK wait in Mqtt.cpp), and messages are
+// queued by Mqtt::publish() and sent from Mqtt::loop() within a time budget,
+// as fast as the socket takes them. If the queue fills up, for instance
+// while the broker is away, the oldest messages are dropped.
+//
+// The broker is set on the web page and kept in Persist::data. Until one
+// is, MQTT stays off and nothing is sent.
+//
+// Each controller connects with its own client ID, client_id(), and
+// publishes under it: "<client ID>/telemetry", "<client ID>/log".
+//
+// Topics are not copied, so they must outlive the message (string literals).
+//
 
 namespace Mqtt
 {
     extern PubSubClient MqttClient;
 
+    const int cQueue = 16;                  // messages waiting to be sent
+    const size_t cbPayloadMax = 256;
+
+    bool publish(const char *szTopic, const uint8_t *pb, size_t cb, bool fRetained = false);
+    bool publish(const char *szTopic, const char *sz, bool fRetained = false);
+    bool connected();
+    const char *client_id();                // "branch-xxxxxx", from the MAC address; set by setup()
+    uint32_t dropped();                     // messages lost because the queue was full
+
+    inline size_t format_value(char *sz, size_t cb, float value) { return snprintf(sz, cb, "%.2f", value); }
+    inline size_t format_value(char *sz, size_t cb, uint32_t value) { return snprintf(sz, cb, "%lu", value); }
+    inline size_t format_value(char *sz, size_t cb, int value) { return snprintf(sz, cb, "%d", value); }
+    inline size_t format_value(char *sz, size_t cb, bool value) { return snprintf(sz, cb, "%d", value); }
+
+    //
+    // Publishes a value to a topic no more than max_publish_rate_per_sec
+    // times a second, and only when it has changed by at least min_change
+    // since it was last published.
+    //
+    // due() applies the same rules without publishing anything, for callers
+    // that batch several values into one message.
+    //
     template <typename T>
     class RateLimitedMqttPublisher
     {
     public:
-        RateLimitedMqttPublisher(const char *topic, float max_publish_rate_per_sec = 10.0, PubSubClient *client = &MqttClient) : topic_(topic), max_publish_rate_per_sec_(max_publish_rate_per_sec), client_(client), last_publish_time_(0)
+        RateLimitedMqttPublisher(const char *topic, float max_publish_rate_per_sec = 10.0, T min_change = T()) : topic_(topic), max_publish_rate_per_sec_(max_publish_rate_per_sec), min_change_(min_change), last_publish_time_(0), last_payload_(), published_(false)
         {
         }
 
-        boolean maybePublish(T payload)
+        // True if payload should be published now, in which case it is
+        // recorded as published
+        boolean due(T payload)
         {
             if (max_publish_rate_per_sec_ <= 0)
                 return false;
 
             const uint32_t current_time = millis();
-            const float duration_since_last_publish_sec = (last_publish_time_ - current_time) / 1000.0;
-            if (duration_since_last_publish_sec < 1.0 / max_publish_rate_per_sec_)
-                return false;
-
-            if (!client_->connected())
+            if (published_)
             {
-                return false;
+                const float duration_since_last_publish_sec = (current_time - last_publish_time_) / 1000.0;
+                if (duration_since_last_publish_sec < 1.0 / max_publish_rate_per_sec_)
+                    return false;
+
+                const T change = payload > last_payload_ ? payload - last_payload_ : last_payload_ - payload;
+                if (payload == last_payload_ || change < min_change_)
+                    return false;
             }
+
             last_publish_time_ = current_time;
-            return client_->publish(topic_, String(payload).c_str());
+            last_payload_ = payload;
+            published_ = true;
+            return true;
+        }
+
+        boolean maybePublish(T payload)
+        {
+            if (!connected() || !due(payload))
+                return false;
+
+            char sz[24];
+            format_value(sz, sizeof(sz), payload);
+            return publish(topic_, sz);
         }
 
+        const char *topic() const { return topic_; }
+
     private:
         const char *topic_;
         float max_publish_rate_per_sec_;
-        PubSubClient *client_;
+        T min_change_;
         uint32_t last_publish_time_;
+        T last_payload_;
+        bool published_;
     };
 
     void setup();
     void loop();
+    void load_persistant_data();
 
 }
 
@@ -3,6 +3,8 @@
 #include <Util.h>
 #include <LED.h>
 #include <Logger.h>
+#include <Profiler.h>
+#include <Stats.h>
 
 using namespace qindesign::network;
 
@@ -28,14 +30,88 @@ namespace OpenPixelControl {
     // it will speed up and only call .show() after the final channel data 
     // has arrived.
     //
+    // Clients that can do better should send the whole frame as a single
+    // channel 0 message instead: up to NUM_STRIPS * LEDS_PER_STRIP pixels,
+    // laid out strip after strip. That frame is shown exactly once, when the
+    // message completes, and the heuristic above is not involved.
+    //
     uint8_t ixHighestChannelSeen = 0;           // 0: we don't know how many channels the client is sending
     bool bNeedToShow = false;                   // true if we are going to refresh the display
 
+    //
+    // OPC over UDP
+    //
+    // Each datagram starts with a 4 byte, big-endian sequence number followed
+    // by one or more complete OPC messages, and is shown as a single frame.
+    // A datagram whose sequence number is not newer than the last one we
+    // accepted is late or out of order and gets dropped rather than shown.
+    // A full 8 strip frame is larger than one Ethernet packet, so it arrives
+    // as IP fragments; if any of them is lost, the whole frame is lost and
+    // the next one takes its place.
+    //
+    // A sender that restarts counts again from a lower sequence number. A
+    // datagram that far behind the last one is taken as a new sender rather
+    // than a late one.
+    //
+    // There's no connection, so we consider a UDP client to be connected for
+    // as long as it keeps sending.
+    //
+    const uint32_t tmUdpTimeout = 2000;         // ms without a datagram before we give up on the client
+    const size_t cUdpQueue = 4;                 // datagrams lwIP holds for us between passes
+    const int32_t dseqRestart = 1000;           // further behind than this: the sender has restarted
+
+    EthernetUDP udp(cUdpQueue);
+    bool fUdpActive = false;
+    uint32_t tmLastDatagram = 0;
+    uint32_t seqLastDatagram = 0;
+
     void setup() {
 
         server.begin();
         status = ready;
-        Logger.println("Open Pixel Control ready");
+        udp.begin(OPEN_PIXEL_UDP_PORT);
+        fUdpActive = false;
+        LOG_INFO(OPC, "Open Pixel Control ready");
+    }
+
+    // Checks whether we can do anything with a message, and complains if not
+    bool message_supported(uint8_t channel, uint8_t command, uint16_t cbMessage) {
+
+        if (command != 0)
+        {
+            LOG_WARN(OPC, "command %d not supported", command);
+            return false;
+        }
+        else if (channel > NUM_STRIPS)
+        {
+            LOG_WARN(OPC, "channel %d not supported", channel);
+            return false;
+        }
+        else if (channel == 0 && cbMessage > (3 * NUM_STRIPS * LEDS_PER_STRIP))
+        {
+            LOG_WARN(OPC, "too many pixels per frame (%d)", cbMessage / 3);
+            return false;
+        }
+        else if (channel != 0 && cbMessage > (3 * LEDS_PER_STRIP))
+        {
+            LOG_WARN(OPC, "too many pixels per strip (%d)", cbMessage / 3);
+            return false;
+        }
+
+        return true;
+    }
+
+    // Where a channel's pixels start in the frame. Channel 0 starts at the
+    // first strip and, since the strips are contiguous, simply runs on into
+    // the following ones.
+    uint32_t channel_offset(uint8_t channel) {
+
+        return channel == 0 ? 0 : (channel - 1) * LEDS_PER_STRIP * 3;
+    }
+
+    uint8_t *channel_buffer(uint8_t channel) {
+
+        return LED::stripBuffer(0) + channel_offset(channel);
     }
 
     // ixHeader is the index we are at in the current OPC message header
@@ -58,8 +134,6 @@ namespace OpenPixelControl {
     // parse this message -- we're just going to swallow it.
     bool bThrowAwayMessage = false;
 
-    uint8_t read_buffer[LEDS_PER_STRIP * 3];
-
     void loop() {
 
         if (status == ready)
@@ -69,7 +143,7 @@ namespace OpenPixelControl {
             client = server.available();
             if (client) {
 
-                Logger.println("OPC client connected");
+                LOG_INFO(OPC, "client connected");
                 LED::openPixelClientConnection(true);
                 status = connected;
                 ixHighestChannelSeen = 0;
@@ -85,7 +159,7 @@ namespace OpenPixelControl {
             {
                 // client has disconnected!
                 client.stop();
-                Logger.println("OPC client disconnected");
+                LOG_INFO(OPC, "client disconnected");
                 LED::openPixelClientConnection(false);
                 status = ready;
                 return;
@@ -96,11 +170,124 @@ namespace OpenPixelControl {
 
         }
 
+        for (size_t i = 0; i < cUdpQueue; i++)
+        {
+            int cbDatagram = udp.parsePacket();
+            if (cbDatagram <= 0)
+                break;
+            read_datagram(cbDatagram);
+        }
+
+        if (fUdpActive && (millis() - tmLastDatagram) > tmUdpTimeout)
+        {
+            LOG_INFO(OPC, "UDP client timed out");
+            LED::openPixelClientConnection(false);
+            fUdpActive = false;
+        }
+
     }
 
 
+    void read_datagram(int cbDatagram) {
+
+        uint8_t rgSeq[4];
+        if (cbDatagram < (int) sizeof(rgSeq) || udp.read(rgSeq, sizeof(rgSeq)) != (int) sizeof(rgSeq))
+            return;
+
+        uint32_t seq = (rgSeq[0] << 24) | (rgSeq[1] << 16) | (rgSeq[2] << 8) | rgSeq[3];
+        LOG_DEBUG(OPC, "datagram %lu, %d bytes", seq, cbDatagram);
+
+        if (!fUdpActive)
+        {
+            LOG_INFO(OPC, "UDP client connected");
+            LED::openPixelClientConnection(true);
+            fUdpActive = true;
+        }
+        else if ((int32_t) (seq - seqLastDatagram) < -dseqRestart)
+        {
+            LOG_INFO(OPC, "UDP client restarted at %lu", seq);
+        }
+        else if ((int32_t) (seq - seqLastDatagram) <= 0)
+        {
+            // late, duplicated or out of order -- a newer frame has already been shown
+            Stats::datagramLate();
+            return;
+        }
+
+        tmLastDatagram = millis();
+        seqLastDatagram = seq;
+
+        // Every message in the datagram is read straight into the back buffer.
+        uint8_t rgHeader[4];
+        bool fAnyPixels = false;
+
+        while (udp.read(rgHeader, sizeof(rgHeader)) == (int) sizeof(rgHeader))
+        {
+            uint8_t channel = rgHeader[0];
+            uint8_t command = rgHeader[1];
+            uint16_t cbMessage = rgHeader[2] << 8 | rgHeader[3];
+
+            if (cbMessage > udp.available())
+            {
+                LOG_WARN(OPC, "truncated UDP message (%d bytes)", cbMessage);
+                break;
+            }
+
+            if (!message_supported(channel, command, cbMessage))
+            {
+                udp.read((uint8_t *) NULL, cbMessage);
+                continue;
+            }
+
+            udp.read(channel_buffer(channel), cbMessage);
+            LED::pixelsReceived(channel_offset(channel), cbMessage);
+            fAnyPixels = true;
+        }
+
+        if (fAnyPixels)
+            LED::show();
+    }
+
+
+    bool receive_messages(const uint8_t *pb, size_t cb) {
+
+        bool fAnyPixels = false;
+
+        while (cb >= 4)
+        {
+            uint8_t channel = pb[0];
+            uint8_t command = pb[1];
+            uint16_t cbMessage = pb[2] << 8 | pb[3];
+            pb += 4;
+            cb -= 4;
+
+            if (cbMessage > cb)
+            {
+                LOG_WARN(OPC, "truncated message (%d bytes)", cbMessage);
+                break;
+            }
+
+            if (message_supported(channel, command, cbMessage))
+            {
+                memcpy(channel_buffer(channel), pb, cbMessage);
+                LED::pixelsReceived(channel_offset(channel), cbMessage);
+                fAnyPixels = true;
+            }
+
+            pb += cbMessage;
+            cb -= cbMessage;
+        }
+
+        return fAnyPixels;
+    }
+
+
+    Profiler::Probe probeReadAvailable("OpenPixelControl::read_available");
+
     void read_available() {
 
+        Profiler::Scope scope(probeReadAvailable);
+
         // how many bytes are even available to read?
         size_t cbAvail = client.available();
         if (cbAvail == 0) 
@@ -121,7 +308,7 @@ namespace OpenPixelControl {
                 return; 
 
             if (ixHeader > 4)
-                Logger.print("Alert! Read past end of header -- this should never happen\n");
+                LOG_ERROR(OPC, "read past end of header -- this should never happen");
 
             if (ixHeader == 4) 
             {
@@ -129,30 +316,25 @@ namespace OpenPixelControl {
                 command = rgHeader[1];
                 cbMessage = rgHeader[2] << 8 | rgHeader[3];
                 ixRGB = 0;  // ready to start reading RGB values
+                LOG_DEBUG(OPC, "channel %d command %d, %d bytes", channel, command, cbMessage);
 
                 //
                 // Anything wrong with the message?
                 //
-                bThrowAwayMessage = false;
+                bThrowAwayMessage = !message_supported(channel, command, cbMessage);
 
-                if (command != 0)
-                {
-                    Logger.printf("OpenPixelControl - command %d not supported\n", command);
-                    bThrowAwayMessage = true;
-                }
-                else if (channel < 1 || channel > 8)
-                {
-                    Logger.printf("OpenPixelControl - channel %d not supported\n", channel);
+                if (channel > NUM_STRIPS)
                     channel = 1;
-                    bThrowAwayMessage = true;
-                }
-                else if (cbMessage > (3 * LEDS_PER_STRIP))
+
+                if (!bThrowAwayMessage)
+                    LED::pixelsReceived(channel_offset(channel), cbMessage);
+
+                if (channel == 0)
                 {
-                    Logger.printf("OpenPixelControl - too many pixels per strip (%d)\n", cbMessage / 3);
-                    bThrowAwayMessage = true;
+                    // a full frame always gets shown
+                    bNeedToShow = !bThrowAwayMessage;
                 }
-
-                if (channel >= ixHighestChannelSeen)
+                else if (channel >= ixHighestChannelSeen)
                 {
                     bNeedToShow = true;
                     ixHighestChannelSeen = channel;
@@ -169,7 +351,7 @@ namespace OpenPixelControl {
 
         if (ixHeader != 4)
         {
-            Logger.println("Alert! impossible header value");
+            LOG_ERROR(OPC, "impossible header value");
         }
 
        
@@ -191,7 +373,6 @@ namespace OpenPixelControl {
         //      -- the number of bytes available
         //      -- the number of bytes that remain to be read (cbMessage - ixRGB)
 
-        uint8_t *pstrip = read_buffer;
         size_t cbToRead = min(cbAvail, cbMessage - ixRGB);
         
         if (bThrowAwayMessage)
@@ -210,11 +391,12 @@ namespace OpenPixelControl {
             return;
         }
 
+        // The pixel bytes go straight from the socket into the LED drawing
+        // memory for this channel. Only the newly arrived bytes are touched,
+        // so a message that trickles in over many reads is still written
+        // exactly once.
+        uint8_t *pstrip = channel_buffer(channel);
         uint32_t cbRead = client.read(pstrip + ixRGB, cbToRead);
-        for (int i = 0; i < LEDS_PER_STRIP; i++)
-        {
-            LED::setPixel(channel - 1, i, read_buffer[(i) * 3], read_buffer[(i * 3) + 1], read_buffer[(i * 3) + 2]);
-        } 
         ixRGB += cbRead;
 
         if (ixRGB >= cbMessage)
@@ -222,7 +404,6 @@ namespace OpenPixelControl {
             // done!
             if (bNeedToShow) {
                 LED::show();
-                LED::CalculateFrameRate();
                 bNeedToShow = false;
             }
             ixHeader = ixRGB = 0;
@@ -11,6 +11,17 @@
 //      we will try to support it well enough for L.E.D. Lab 
 //      (in FadeCandy mode).
 //
+//      Channels 1-8 address a single strip each. Channel 0 is
+//      a full-frame message covering all strips, one after the
+//      other, and is shown as soon as it has been received.
+//
+//      The same messages are also accepted over UDP on
+//      OPEN_PIXEL_UDP_PORT, prefixed by a sequence number so that
+//      stale frames can be dropped. See OpenPixelControl.cpp.
+//
+//      Other transports that hand us whole messages (WebSocket) use
+//      receive_messages().
+//
 
 
 namespace OpenPixelControl {
@@ -18,5 +29,14 @@ namespace OpenPixelControl {
     void setup();
     void loop();
     void read_available();
+    void read_datagram(int cbDatagram);
+
+    bool message_supported(uint8_t channel, uint8_t command, uint16_t cbMessage);
+    uint32_t channel_offset(uint8_t channel);
+    uint8_t *channel_buffer(uint8_t channel);
+
+    // Copies a buffer of complete OPC messages into the back buffer,
+    // returns true if it held any pixels. Doesn't show the frame.
+    bool receive_messages(const uint8_t *pb, size_t cb);
 
 }
\ No newline at end of file
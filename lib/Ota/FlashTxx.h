@@ -85,7 +85,7 @@
   #define FLASH_SIZE        (0x800000)     // 8MB
   #define FLASH_SECTOR_SIZE (0x1000)       // 4KB sector size
   #define FLASH_WRITE_SIZE  (4)            // 4-byte/32-bit writes
-  #define FLASH_RESERVE     (64*FLASH_SECTOR_SIZE) // reserve top of flash
+  #define FLASH_RESERVE     (72*FLASH_SECTOR_SIZE) // reserve top of flash: EEPROM emulation, and 8 sectors of config below it (see ConfigStore.h)
   #define FLASH_BASE_ADDR   (0x60000000)   // code starts here
 #elif defined(__IMXRT1062__) && defined(ARDUINO_TEENSY_MICROMOD)
   #define FLASH_ID		"fw_teensyMM"		// target ID (in code)
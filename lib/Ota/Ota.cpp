@@ -8,6 +8,7 @@
 #include <QNEthernet.h>
 #include <Util.h>
 #include <Logger.h>
+#include <Persist.h>
 #include <TeensyOtaUpdater.h>
 
 using namespace qindesign::network;
@@ -15,6 +16,8 @@ using namespace qindesign::network;
 namespace Ota
 {
 
+  const uint32_t usDrainBeforeReboot = 50000;    // time to get the last messages out of the log
+
   TeensyOtaUpdater *tOtaUpdater;
   AsyncWebServer *webServer;
   bool updateAvailable;
@@ -42,7 +45,7 @@ namespace Ota
 
   void TOA_Callack()
   {
-    Serial.println("An update is available");
+    LOG_INFO(OTA, "An update is available");
     updateAvailable = true;
   }
 
@@ -60,7 +63,7 @@ namespace Ota
     tOtaUpdater->registerCallback(TOA_Callack);
 
     webServer->begin();
-    Logger.println("OTA ready");
+    LOG_INFO(OTA, "OTA ready");
   }
 
   ////////////////////////// loop() ////////////////////////////////
@@ -69,7 +72,12 @@ namespace Ota
     if (updateAvailable)
     {
       // Notify other layers (to display a status that about to reboot or smth)
-      Serial.println("Applying udpate");
+      LOG_INFO(OTA, "Applying update");
+      Persist::write();
+
+      // the log task won't get another chance
+      Logger.drain(usDrainBeforeReboot);
+      Serial.flush();
 
       // This function does not return
       tOtaUpdater->applyUpdate();
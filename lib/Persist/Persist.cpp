@@ -1,11 +1,252 @@
 #include <Persist.h>
+#include <type_traits>
 #include <Logger.h>
 #include <EEPROM.h>
+#include <ConfigStore.h>
+#include <LED.h>
 
 namespace Persist
 {
 
     persistence_t data;
+    persistence_t stored;           // what the config store holds, to find what changed
+
+    const uint32_t tmQuiet = 2000;          // ms without a change before we write
+    const uint32_t tmMaxDelay = 30000;      // ms a change can wait while others, or frames, keep coming
+
+    bool fDirty = false;
+    uint32_t tmFirstChange;
+    uint32_t tmLastChange;
+
+    //
+    // Every persisted field has a tag that identifies it in the config store.
+    // Tags are forever: never renumber one, or reuse the tag of a field that
+    // has been removed.
+    //
+    // When a stored record doesn't match the field:
+    //
+    //      tag unknown             the field was removed, ignore it
+    //      no record               a new field, it keeps its default
+    //      array, different size   the array grew or shrank, copy the
+    //                              elements both have in common
+    //      number, different size  the type was widened or narrowed (say
+    //                              uint8_t to uint16_t, float to double),
+    //                              convert the value, see migrate_field()
+    //      anything else           keep the default
+    //
+    // Records don't say what type they were written as, so a field that
+    // changes between integer and floating point, or between signed and
+    // unsigned, needs a new tag.
+    //
+    enum Kind : uint8_t { kindBytes, kindBool, kindUnsigned, kindSigned, kindFloat };
+
+    template <typename T>
+    constexpr Kind kind_of()
+    {
+        return std::is_same<T, bool>::value ? kindBool
+             : std::is_floating_point<T>::value ? kindFloat
+             : std::is_integral<T>::value ? (std::is_signed<T>::value ? kindSigned : kindUnsigned)
+             : kindBytes;
+    }
+
+    struct field_t {
+        uint16_t tag;
+        uint16_t ib;                // offset in persistence_t
+        uint16_t cb;
+        uint16_t cbElement;         // == cb unless it's an array
+        Kind kind;                  // kindBytes for arrays and structs
+    };
+
+#define FIELD(tag, member) { tag, offsetof(persistence_t, member), sizeof(persistence_t::member), sizeof(persistence_t::member), kind_of<decltype(persistence_t::member)>() }
+#define ARRAY_FIELD(tag, member) { tag, offsetof(persistence_t, member), sizeof(persistence_t::member), sizeof(persistence_t::member[0]), kindBytes }
+
+    const field_t rgFields[] = {
+        FIELD(1, rgbSolidColor),
+        FIELD(2, pattern),
+        FIELD(3, static_ip),
+        ARRAY_FIELD(4, ip_addr),
+        ARRAY_FIELD(5, mask),
+        ARRAY_FIELD(6, gateway),
+        FIELD(7, center_orientation),
+        ARRAY_FIELD(8, dmx_map),
+        ARRAY_FIELD(9, strip_length),
+        ARRAY_FIELD(10, strip_enabled),
+        FIELD(11, gamma),
+        FIELD(12, brightness),
+        ARRAY_FIELD(13, white_point),
+        FIELD(14, dither),
+        ARRAY_FIELD(15, mqtt_broker),
+        FIELD(16, mqtt_port),
+    };
+
+    const int cFields = sizeof(rgFields) / sizeof(rgFields[0]);
+
+    // Converts a number stored with a different width, clamped to what the
+    // field can hold. Returns false if the field isn't a number or the
+    // stored width makes no sense for it.
+    bool migrate_field(const field_t &field, const uint8_t *pb, uint16_t cb)
+    {
+        uint8_t *pbField = (uint8_t *)&data + field.ib;
+
+        if (field.kind == kindFloat)
+        {
+            double d;
+            if (cb == sizeof(float))
+            {
+                float f;
+                memcpy(&f, pb, sizeof(f));
+                d = f;
+            }
+            else if (cb == sizeof(double))
+                memcpy(&d, pb, sizeof(d));
+            else
+                return false;
+
+            if (field.cb == sizeof(float))
+            {
+                float f = d;
+                memcpy(pbField, &f, sizeof(f));
+            }
+            else
+                memcpy(pbField, &d, sizeof(d));
+            return true;
+        }
+
+        if (field.kind == kindBytes || (cb != 1 && cb != 2 && cb != 4 && cb != 8))
+            return false;
+
+        // little-endian, like everything we store
+        uint64_t u = 0;
+        memcpy(&u, pb, cb);
+        if (field.kind == kindSigned && cb < 8 && (pb[cb - 1] & 0x80))
+            u |= ~0ULL << (8 * cb);
+
+        uint32_t cBits = 8 * field.cb;
+        if (field.kind == kindBool)
+            u = u != 0;
+        else if (field.kind == kindUnsigned && cBits < 64)
+            u = min(u, (1ULL << cBits) - 1);
+        else if (field.kind == kindSigned && cBits < 64)
+            u = (uint64_t)constrain((int64_t)u, -(1LL << (cBits - 1)), (1LL << (cBits - 1)) - 1);
+
+        memcpy(pbField, &u, field.cb);
+        LOG_INFO(PERSIST, "Stored field %d converted from %d to %d bytes", field.tag, cb, field.cb);
+        return true;
+    }
+
+    void load_field(uint16_t tag, const uint8_t *pb, uint16_t cb)
+    {
+        for (const field_t &field : rgFields)
+        {
+            if (field.tag != tag)
+                continue;
+
+            uint8_t *pbField = (uint8_t *)&data + field.ib;
+
+            if (cb == field.cb)
+                memcpy(pbField, pb, cb);
+            else if (field.cbElement != field.cb && cb % field.cbElement == 0)
+                memcpy(pbField, pb, min(cb, field.cb));
+            else if (!migrate_field(field, pb, cb))
+                LOG_WARN(PERSIST, "Stored field %d is %d bytes, expected %d. Using the default.", tag, cb, field.cb);
+            return;
+        }
+    }
+
+    // Writes every field into a new sector of the config store, trying each
+    // sector but the one holding the last snapshot
+    void snapshot()
+    {
+        for (int cTries = 0; cTries < ConfigStore::cSectors - 1; cTries++)
+        {
+            bool fOk = ConfigStore::begin_snapshot();
+
+            for (int i = 0; fOk && i < cFields; i++)
+                fOk = ConfigStore::append(rgFields[i].tag, (uint8_t *)&data + rgFields[i].ib, rgFields[i].cb);
+
+            if (fOk && ConfigStore::commit())
+            {
+                stored = data;
+                return;
+            }
+        }
+
+        LOG_ERROR(PERSIST, "Config could not be saved");
+    }
+
+    void mark_dirty()
+    {
+        tmLastChange = millis();
+        if (!fDirty)
+        {
+            tmFirstChange = tmLastChange;
+            fDirty = true;
+        }
+    }
+
+    void loop()
+    {
+        if (!fDirty)
+            return;
+
+        // Writing to flash stops everything, for tens of ms if a sector has
+        // to be erased, so it waits while a client is streaming frames
+        uint32_t tmNow = millis();
+        bool fWait = (tmNow - tmLastChange) < tmQuiet || LED::receivingPixels();
+        if (fWait && (tmNow - tmFirstChange) < tmMaxDelay)
+            return;
+
+        write();
+    }
+
+    // Appends the fields that have changed since they were last stored
+    void write()
+    {
+        fDirty = false;
+
+        for (const field_t &field : rgFields)
+        {
+            uint8_t *pbField = (uint8_t *)&data + field.ib;
+            uint8_t *pbStored = (uint8_t *)&stored + field.ib;
+
+            if (memcmp(pbField, pbStored, field.cb) == 0)
+                continue;
+
+            LOG_DEBUG(PERSIST, "Writing field %d, %d bytes", field.tag, field.cb);
+            if (!ConfigStore::append(field.tag, pbField, field.cb))
+            {
+                // the sector is full: start the next one with everything
+                snapshot();
+                return;
+            }
+            memcpy(pbStored, pbField, field.cb);
+        }
+    }
+
+    // Settings used to be kept in EEPROM: "bC", then persistence_t byte for
+    // byte, starting with its size. Fields have only ever been added at the
+    // end, so every field that fits in what was stored is still valid.
+    bool import_eeprom()
+    {
+        if (EEPROM.read(0) != 'b' || EEPROM.read(1) != 'C')
+            return false;
+
+        uint16_t cbOnDisk = EEPROM.read(2) | (EEPROM.read(3) << 8);
+        LOG_DEBUG(PERSIST, "Data on EEPROM is %d bytes", cbOnDisk);
+
+        persistence_t legacy;
+        uint8_t *pbLegacy = (uint8_t *)&legacy;
+        uint16_t cbToRead = min((size_t)cbOnDisk, sizeof(legacy));
+        for (uint16_t i = 2; i < cbToRead; i++)
+            pbLegacy[i] = EEPROM.read(i + 2);        // skip over the signature
+
+        for (const field_t &field : rgFields)
+        {
+            if (field.ib + field.cb <= cbToRead)
+                memcpy((uint8_t *)&data + field.ib, pbLegacy + field.ib, field.cb);
+        }
+        return true;
+    }
 
     void setup()
     {
@@ -31,53 +272,59 @@ namespace Persist
         data.gateway[3] = 1;
         data.center_orientation = 0;
 
-        Logger.printf("Initializing Persisted Data\n");
+        // No color correction until someone asks for it at /color, so that
+        // installs set up before it existed look exactly as they did. FadeCandy
+        // uses gamma 2.5 and dithering.
+        data.gamma = 1.0;
+        data.brightness = 255;
+        data.white_point[0] = 255;
+        data.white_point[1] = 255;
+        data.white_point[2] = 255;
+        data.dither = false;
 
-        byte bSig[2];
-        bSig[0] = EEPROM.read(0);
-        bSig[1] = EEPROM.read(1);
+        // there's no broker everyone can be expected to have
+        memset(data.mqtt_broker, 0, sizeof(data.mqtt_broker));
+        data.mqtt_port = 1883;
 
-        Logger.printf("Signature read - %d %d\n", bSig[0], bSig[1]);
-        if (bSig[0] == 'b' && bSig[1] == 'C')
+        for (int i = 0; i < NUM_STRIPS; i++)
         {
-            // read EEPROM now - start with cb!
-            uint16_t cbOnDisk = 0;
-            uint8_t *pb = (uint8_t *)&cbOnDisk;
-            pb[0] = EEPROM.read(2);
-            pb[1] = EEPROM.read(3);
-
-            Logger.printf("Data on EEPROM is %d bytes\n", cbOnDisk);
+            data.strip_length[i] = LEDS_PER_STRIP;
+            data.strip_enabled[i] = true;
+        }
 
-            if (cbOnDisk != sizeof(data))
-            {
-                Logger.printf("Data size on EEPROM doesn't match the code (%d!=%d). Reverting to default values.\n", cbOnDisk, sizeof(data));
-                write();
-            }
-            else
+        // By default, universes 1, 2, 3... fill all the strips back to back
+        for (int i = 0; i < DMX_MAX_UNIVERSES; i++)
+        {
+            uint32_t ixPixel = i * DMX_PIXELS_PER_UNIVERSE;
+            if (ixPixel < NUM_STRIPS * LEDS_PER_STRIP)
             {
-                // Don't read more than sizeof(data) or cbOnDisk
-                uint8_t *pbData = (uint8_t *)&data;
-                uint16_t cbToRead = min(cbOnDisk, sizeof(data)) - 2; // -2 because we're not reading cb again
-                Logger.printf("\n");
-                Logger.printf("\n");
-                for (uint16_t i = 0; i < cbToRead; i++)
-                {
-                    pbData[i + 2] = EEPROM.read(i + 4); // skip over signature and cb
-                    // Logger.printf("%x ", pbData[i+2]);
-                }
-                Logger.printf("\n");
-                Logger.printf("\n");
+                data.dmx_map[i].universe = i + 1;
+                data.dmx_map[i].strip = ixPixel / LEDS_PER_STRIP;
+                data.dmx_map[i].pixel = ixPixel % LEDS_PER_STRIP;
             }
         }
+
+        stored = data;
+
+        if (ConfigStore::load(load_field))
+        {
+            LOG_INFO(PERSIST, "Config loaded from flash");
+            stored = data;
+        }
+        else if (import_eeprom())
+        {
+            LOG_INFO(PERSIST, "Config imported from EEPROM");
+            snapshot();
+        }
         else
         {
-            Logger.printf("Signature not found - not reading from EEPROM\n");
-            write();
+            LOG_INFO(PERSIST, "No config stored, using defaults");
+            snapshot();
         }
 
-        Logger.printf("cb: %d color: %x pattern: %d \n"
+        LOG_INFO(PERSIST, "cb: %d color: %x pattern: %d \n"
                       "       static ip: %d  ip addr: %d.%d.%d.%d\n"
-                      "       mask: %d.%d.%d.%d gateway: %d.%d.%d.%d\n",
+                      "       mask: %d.%d.%d.%d gateway: %d.%d.%d.%d",
                       data.cb,
                       data.rgbSolidColor,
                       data.pattern,
@@ -96,21 +343,4 @@ namespace Persist
                       data.gateway[3]);
     }
 
-    void write()
-    {
-
-        Logger.printf("Persist::Write with %d bytes\n", data.cb);
-
-        for (uint16_t i = 0; i < data.cb; i++)
-        {
-            uint8_t *pb = (uint8_t *)&data;
-            EEPROM.write(i + 2, pb[i]);
-        }
-        // if we haven't crashed yet, write the signature marks
-        EEPROM.write(0, 'b');
-        EEPROM.write(1, 'C');
-
-        Logger.printf("Persist::Write done\n");
-    }
-
-}
\ No newline at end of file
+}
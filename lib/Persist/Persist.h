@@ -1,14 +1,26 @@
 #pragma once
 
-// Code for persisting configuration data to the Teensy EEPROM
+// Code for persisting configuration data
 //
-// When we store things in EEPROM we store two bytes "bC" in the first
-// two bytes. If we ever read anything else there, we assume that
-// EEPROM is not initialized.
+// Persist::data is kept in the ConfigStore journal in flash, one record
+// per field, each identified by a tag (see rgFields in Persist.cpp).
+// Persist::write() only appends the fields that have changed. Adding,
+// removing or resizing a field doesn't lose the other settings.
 //
-// Then we store a persistence_t structure, byte-for-byte. The 
-// first uint16_t of the structure contains the size of the structure
-// as stored, in bytes.
+// Settings used to be a byte-for-byte copy of persistence_t in EEPROM,
+// after the two bytes "bC". If the journal is empty, they are imported
+// from there once.
+//
+// Nothing is written while a setting is being changed. Whoever changes
+// Persist::data calls mark_dirty(), and loop() writes the changes once
+// nothing has changed for a while. A slider dragged around in the UI then
+// costs one write rather than dozens.
+//
+// Flash can't be read while it's being written, so the write holds up
+// frame output: a few hundred us to append, tens of ms when a sector has to
+// be erased. It waits for as long as a pixel client is sending frames, but
+// no longer than tmMaxDelay after the first change; a client that streams
+// for longer than that will see the one stall.
 //
 
 #include <Arduino.h>
@@ -17,9 +29,17 @@
 
 namespace Persist {
 
+    // Where the pixels of one sACN / Art-Net universe go. Data that runs past
+    // the end of the strip continues on the next one.
+    struct dmx_universe_t {
+        uint16_t    universe;           // sACN universe number (Art-Net port address + 1), 0 = unused
+        uint8_t     strip;              // 0 .. NUM_STRIPS-1
+        uint16_t    pixel;              // first pixel on that strip
+    };
+
     struct persistence_t {
 
-        uint16_t    cb;                 // Must always be sizeof(persistence_t) - for versioning
+        uint16_t    cb;                 // sizeof(persistence_t), only here to keep the layout of the EEPROM image
 
         int         rgbSolidColor;      // current color to display 
         uint8_t     pattern;            // whether we are in solid color mode (0) or test pattern (1) -- maps to enum Pattern in LED.cpp
@@ -29,11 +49,23 @@ namespace Persist {
         byte        mask[4];         // IP address for static IP
         byte        gateway[4];         // IP address for static IP
         float       center_orientation; // To calibrate the orientation of head facing towards the center
+        dmx_universe_t dmx_map[DMX_MAX_UNIVERSES]; // sACN / Art-Net universe to pixel mapping
+        uint16_t    strip_length[NUM_STRIPS];  // number of LEDs actually attached to each output
+        bool        strip_enabled[NUM_STRIPS]; // false: output is kept dark and never encoded
+        float       gamma;              // applied to every color channel, 1.0 = linear
+        uint8_t     brightness;         // 0 - 255
+        uint8_t     white_point[3];     // red, green, blue scale, 255 = full
+        bool        dither;             // temporal dithering of the bits lost to gamma and brightness
+        byte        mqtt_broker[4];     // IP address of the MQTT broker, 0.0.0.0 = MQTT off
+        uint16_t    mqtt_port;
     };
 
     extern persistence_t data;
     
     void setup();
-    void write();
+    void loop();
+
+    void mark_dirty();                  // Persist::data has changed, write it soon
+    void write();                       // write what has changed right now
 
 }
\ No newline at end of file
@@ -0,0 +1,77 @@
+#include <Profiler.h>
+
+namespace Profiler {
+
+    Probe *pFirstProbe = NULL;
+
+    void Probe::begin(const char *szName)
+    {
+        szName_ = szName;
+        pNext_ = pFirstProbe;
+        pFirstProbe = this;
+    }
+
+    void Probe::reset()
+    {
+        cCalls_ = 0;
+        cyclesMin_ = UINT32_MAX;
+        cyclesMax_ = 0;
+        cyclesTotal_ = 0;
+        memset(rgBuckets_, 0, sizeof(rgBuckets_));
+    }
+
+    uint32_t Probe::percentile(uint32_t permille) const
+    {
+        uint32_t cTarget = ((uint64_t) cCalls_ * permille + 999) / 1000;
+        uint32_t cSeen = 0;
+
+        for (int i = 0; i < cBuckets; i++)
+        {
+            cSeen += rgBuckets_[i];
+            if (cSeen >= cTarget && cSeen > 0)
+            {
+                // undo bucket()
+                if (i < (1 << cSubBucketBits))
+                    return i;
+                int log2 = (i >> cSubBucketBits) + cSubBucketBits - 1;
+                int sub = i & ((1 << cSubBucketBits) - 1);
+                return (1 << log2) | (sub << (log2 - cSubBucketBits));
+            }
+        }
+        return cyclesMax_;
+    }
+
+    void setup() {
+
+        // The Teensy 4 startup code already does this, but it costs nothing
+        ARM_DEMCR |= ARM_DEMCR_TRCENA;
+        ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+    }
+
+    void reset() {
+
+        for (Probe *p = pFirstProbe; p != NULL; p = p->pNext_)
+            p->reset();
+    }
+
+    size_t format_json(char *sz, size_t cb) {
+
+        size_t ich = snprintf(sz, cb, "{ \"cpu_mhz\": %lu", F_CPU_ACTUAL / 1000000);
+
+        for (Probe *p = pFirstProbe; p != NULL && ich < cb; p = p->pNext_)
+        {
+            uint32_t cyclesAvg = p->cCalls_ ? (uint32_t) (p->cyclesTotal_ / p->cCalls_) : 0;
+            ich += snprintf(sz + ich, cb - ich,
+                            ", \"%s\": { \"calls\": %lu, \"min\": %lu, \"avg\": %lu, \"max\": %lu, \"p99\": %lu }",
+                            p->szName_, p->cCalls_,
+                            p->cCalls_ ? p->cyclesMin_ : 0, cyclesAvg, p->cyclesMax_,
+                            p->percentile(990));
+        }
+
+        if (ich < cb)
+            ich += snprintf(sz + ich, cb - ich, " }");
+
+        return min(ich, cb - 1);
+    }
+
+}
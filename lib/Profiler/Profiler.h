@@ -0,0 +1,89 @@
+#pragma once
+
+// Cycle-accurate profiling based on the Cortex-M7 cycle counter (DWT CYCCNT)
+//
+// A Probe collects min / average / max and a histogram of cycle counts.
+// To measure a block of code, put a Scope on the stack:
+//
+//      Profiler::Probe probeShow("LED::show");
+//      ...
+//      {
+//          Profiler::Scope scope(probeShow);
+//          ...
+//      }
+//
+// Recording costs a couple of loads, a count-leading-zeros and an
+// increment, so probes can stay in the hot paths. Every probe is served
+// at /profile; /profile?reset=1 starts over.
+//
+// The histogram has 4 buckets per power of two, so percentiles are
+// accurate to within about 20%.
+//
+
+#include <Arduino.h>
+
+namespace Profiler {
+
+    const int cSubBucketBits = 2;
+    const int cBuckets = 32 << cSubBucketBits;
+
+    class Probe
+    {
+    public:
+        Probe() {}
+        Probe(const char *szName) { begin(szName); }
+
+        // Names the probe and adds it to the list that gets reported
+        void begin(const char *szName);
+        void reset();
+
+        inline void record(uint32_t cycles)
+        {
+            cCalls_++;
+            cyclesTotal_ += cycles;
+            if (cycles < cyclesMin_)
+                cyclesMin_ = cycles;
+            if (cycles > cyclesMax_)
+                cyclesMax_ = cycles;
+            rgBuckets_[bucket(cycles)]++;
+        }
+
+        // Lower bound of the bucket holding the given per-mille point
+        uint32_t percentile(uint32_t permille) const;
+
+        static inline int bucket(uint32_t cycles)
+        {
+            if (cycles < (1 << cSubBucketBits))
+                return cycles;
+            int log2 = 31 - __builtin_clz(cycles);
+            int sub = (cycles >> (log2 - cSubBucketBits)) & ((1 << cSubBucketBits) - 1);
+            return ((log2 - cSubBucketBits + 1) << cSubBucketBits) + sub;
+        }
+
+        const char *szName_ = NULL;
+        uint32_t cCalls_ = 0;
+        uint32_t cyclesMin_ = UINT32_MAX;
+        uint32_t cyclesMax_ = 0;
+        uint64_t cyclesTotal_ = 0;
+        uint32_t rgBuckets_[cBuckets] = {};
+        Probe *pNext_ = NULL;
+    };
+
+    class Scope
+    {
+    public:
+        inline Scope(Probe &probe) : probe_(probe), cyclesStart_(ARM_DWT_CYCCNT) {}
+        inline ~Scope() { probe_.record(ARM_DWT_CYCCNT - cyclesStart_); }
+
+    private:
+        Probe &probe_;
+        uint32_t cyclesStart_;
+    };
+
+    void setup();
+    void reset();
+
+    // Writes every probe as JSON, returns the length
+    size_t format_json(char *sz, size_t cb);
+
+}
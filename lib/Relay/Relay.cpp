@@ -1,4 +1,19 @@
 #include "Relay.h"
 #include "BranchController.h"
+#include "Logger.h"
 
-GpioRelay Relay(pinRelay);
\ No newline at end of file
+GpioRelay Relay(pinRelay);
+
+void GpioRelay::open()
+{
+    digitalWrite(pin_, LOW);
+    is_closed_ = false;
+    LOG_INFO(RELAY, "setting relay to LOW");
+}
+
+void GpioRelay::close()
+{
+    digitalWrite(pin_, HIGH);
+    is_closed_ = true;
+    LOG_INFO(RELAY, "setting relay to HIGH");
+}
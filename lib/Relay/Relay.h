@@ -1,7 +1,6 @@
 #ifndef _RELAY_H_
 #define _RELAY_H_
 
-#include "Logger.h"
 #include "Arduino.h"
 
 class GpioRelay
@@ -18,24 +17,14 @@ public:
         return !is_closed();
     }
 
-    void open()
-    {
-        digitalWrite(pin_, LOW);
-        is_closed_ = false;
-        Logger.println("Setting relay to LOW");
-    }
+    void open();
 
     bool is_closed()
     {
         return is_closed_;
     }
 
-    void close()
-    {
-        digitalWrite(pin_, HIGH);
-        is_closed_ = true;
-        Logger.println("Setting relay to HIGH");
-    }
+    void close();
 
     private:
         uint8_t pin_;
@@ -137,7 +137,7 @@ public:
         pocto = new OctoWS2811(nPixels, framebuffer, drawbuffer, config);
         pocto->begin();
 
-        Logger.printf("Now supporting %d pixels per strip\n", nPixels);
+        LOG_INFO(LED, "now supporting %d pixels per strip", nPixels);
     }
 
     // change the RGB/GRB order of the strips, at runtime!
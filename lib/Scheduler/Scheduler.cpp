@@ -0,0 +1,113 @@
+#include <Scheduler.h>
+#include <Logger.h>
+
+namespace Scheduler {
+
+    // kept sorted by priority
+    task_t rgTasks[cMaxTasks];
+    int cTasks = 0;
+
+    Profiler::Probe rgProbes[cMaxTasks];
+
+    void add(const char *szName, TaskFunction pfn, uint32_t usPeriod, Priority priority, uint32_t usSlice) {
+
+        if (cTasks >= cMaxTasks)
+        {
+            LOG_ERROR(SYS, "too many tasks, %s not added", szName);
+            return;
+        }
+
+        int ix = cTasks;
+        while (ix > 0 && rgTasks[ix - 1].priority > priority)
+        {
+            rgTasks[ix] = rgTasks[ix - 1];
+            ix--;
+        }
+
+        task_t &task = rgTasks[ix];
+        memset(&task, 0, sizeof(task));
+        task.szName = szName;
+        task.pfn = pfn;
+        task.usPeriod = usPeriod;
+        task.priority = priority;
+        task.usSlice = usSlice;
+        task.usLastRun = micros();
+        task.ixProbe = cTasks;
+        rgProbes[cTasks].begin(szName);
+        cTasks++;
+    }
+
+    bool due(const task_t &task, uint32_t usNow) {
+
+        return task.usPeriod == 0 || (usNow - task.usLastRun) >= task.usPeriod;
+    }
+
+    void run(task_t &task, uint32_t usNow) {
+
+        if (task.usPeriod != 0 && (usNow - task.usLastRun) >= 2 * task.usPeriod)
+            task.cMissedDeadlines++;
+
+        task.usLastRun = usNow;
+        {
+            Profiler::Scope scope(rgProbes[task.ixProbe]);
+            task.pfn();
+        }
+
+        uint32_t us = micros() - usNow;
+        task.cRuns++;
+        task.usMax = max(task.usMax, us);
+        if (us > task.usSlice)
+            task.cOverruns++;
+    }
+
+    void run_frame_tasks() {
+
+        for (int i = 0; i < cTasks && rgTasks[i].priority == priorityFrame; i++)
+        {
+            uint32_t usNow = micros();
+            if (due(rgTasks[i], usNow))
+                run(rgTasks[i], usNow);
+        }
+    }
+
+    void loop() {
+
+        run_frame_tasks();
+
+        for (int i = 0; i < cTasks; i++)
+        {
+            task_t &task = rgTasks[i];
+            if (task.priority == priorityFrame)
+                continue;
+
+            uint32_t usNow = micros();
+            if (!due(task, usNow))
+                continue;
+
+            run(task, usNow);
+
+            // frames first, before the next lower priority task gets a go
+            run_frame_tasks();
+        }
+    }
+
+    size_t format_json(char *sz, size_t cb) {
+
+        size_t ich = snprintf(sz, cb, "{");
+
+        for (int i = 0; i < cTasks && ich < cb; i++)
+        {
+            const task_t &task = rgTasks[i];
+            ich += snprintf(sz + ich, cb - ich,
+                            "%s \"%s\": { \"runs\": %lu, \"max_us\": %lu, \"missed\": %lu, \"overruns\": %lu }",
+                            i == 0 ? "" : ",",
+                            task.szName, task.cRuns, task.usMax, task.cMissedDeadlines, task.cOverruns);
+        }
+
+        if (ich < cb)
+            ich += snprintf(sz + ich, cb - ich, " }");
+
+        return min(ich, cb - 1);
+    }
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+// A small cooperative scheduler for the main loop
+//
+// Each module registers its loop function as a task with a period, a
+// priority and the time slice it is expected to stay within. Nothing is
+// preempted for real: a task always runs to completion. What we do instead
+// is run every due priorityFrame task again after each lower priority task,
+// so frame ingest and output never wait for more than one housekeeping task.
+//
+// Per task we count runs, missed deadlines (the task ran more than a whole
+// period late) and overruns (the task took longer than its slice). They
+// are served as JSON at /scheduler. Each task also gets a Profiler probe
+// with the task's name.
+//
+
+#include <Arduino.h>
+#include <Profiler.h>
+
+namespace Scheduler {
+
+    enum Priority { priorityFrame = 0, priorityNormal, priorityHousekeeping };
+
+    typedef void (*TaskFunction)();
+
+    struct task_t {
+        const char  *szName;
+        TaskFunction pfn;
+        uint32_t    usPeriod;           // 0: run on every pass
+        Priority    priority;
+        uint32_t    usSlice;            // expected maximum run time
+        uint32_t    usLastRun;
+        uint32_t    usMax;              // longest run so far
+        uint32_t    cRuns;
+        uint32_t    cMissedDeadlines;
+        uint32_t    cOverruns;
+        int         ixProbe;            // into the probes, which never move
+    };
+
+    const int cMaxTasks = 16;
+
+    // Tasks of equal priority run in the order they were added
+    void add(const char *szName, TaskFunction pfn, uint32_t usPeriod, Priority priority, uint32_t usSlice);
+    void loop();
+
+    // Writes the task counters as JSON, returns the length
+    size_t format_json(char *sz, size_t cb);
+
+}
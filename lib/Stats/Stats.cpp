@@ -0,0 +1,103 @@
+#include <Stats.h>
+
+namespace Stats {
+
+    second_t current;
+    second_t last;
+    uint32_t tmSecondStart = 0;
+
+    // Start of the frame being assembled, and of the one waiting to be shown
+    bool fFrameStarted = false;
+    uint32_t usFrameStart = 0;
+    bool fPendingStarted = false;
+    uint32_t usPendingStart = 0;
+
+    void setup() {
+
+        memset(&current, 0, sizeof(current));
+        memset(&last, 0, sizeof(last));
+        tmSecondStart = millis();
+    }
+
+    void loop() {
+
+        if ((millis() - tmSecondStart) < 1000)
+            return;
+
+        last = current;
+        memset(&current, 0, sizeof(current));
+        tmSecondStart = millis();
+    }
+
+    void frameStarted() {
+
+        if (fFrameStarted)
+            return;
+
+        usFrameStart = micros();
+        fFrameStarted = true;
+    }
+
+    void frameCompleted(bool fDropped) {
+
+        if (fDropped)
+            current.cFramesDropped++;
+
+        usPendingStart = usFrameStart;
+        fPendingStarted = fFrameStarted;
+        fFrameStarted = false;
+    }
+
+    void frameShown(bool fRefresh, uint32_t usEncode, uint32_t usShow) {
+
+        current.usEncode += usEncode;
+        current.usShow += usShow;
+        current.usShowMax = max(current.usShowMax, usShow);
+
+        if (fRefresh)
+        {
+            current.cFramesRefreshed++;
+            return;
+        }
+
+        current.cFramesShown++;
+
+        if (fPendingStarted)
+        {
+            uint32_t usLatency = micros() - usPendingStart;
+            int ixBucket = 31 - __builtin_clz(usLatency | 1);
+            current.rgLatency[min(ixBucket, cLatencyBuckets - 1)]++;
+            fPendingStarted = false;
+        }
+    }
+
+    void ingestTime(uint32_t us) {
+
+        current.usIngest += us;
+    }
+
+    void datagramLate() {
+
+        current.cDatagramsLate++;
+    }
+
+    size_t format_json(char *sz, size_t cb) {
+
+        size_t ich = snprintf(sz, cb,
+                              "{ \"fps\": %lu, \"refreshed\": %lu, \"dropped\": %lu, "
+                              "\"encode_us\": %lu, \"show_us\": %lu, \"show_max_us\": %lu, \"ingest_us\": %lu, "
+                              "\"late_datagrams\": %lu, \"latency_us_log2\": [",
+                              last.cFramesShown, last.cFramesRefreshed, last.cFramesDropped,
+                              last.usEncode, last.usShow, last.usShowMax, last.usIngest,
+                              last.cDatagramsLate);
+
+        for (int i = 0; i < cLatencyBuckets && ich < cb; i++)
+            ich += snprintf(sz + ich, cb - ich, i == 0 ? "%lu" : ", %lu", last.rgLatency[i]);
+
+        if (ich < cb)
+            ich += snprintf(sz + ich, cb - ich, "] }");
+
+        return min(ich, cb - 1);
+    }
+
+}
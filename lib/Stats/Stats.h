@@ -0,0 +1,47 @@
+#pragma once
+
+// Frame timing instrumentation
+//
+// Counters are collected for one second at a time. Stats::last holds
+// the most recently completed second, which is what we report over HTTP
+// (/stats) and WebSocket ("stats").
+//
+// Latency is measured from the first pixel byte of a frame arriving
+// (LED::pixelsReceived) to that frame being handed to the DMA engine.
+// The histogram buckets are powers of two: bucket n counts latencies of
+// 2^n to 2^(n+1)-1 microseconds, and the last one everything longer.
+//
+
+#include <Arduino.h>
+
+namespace Stats {
+
+    const int cLatencyBuckets = 16;
+
+    struct second_t {
+        uint32_t    cFramesShown;       // new frames sent to the strips
+        uint32_t    cFramesRefreshed;   // the same frame sent again, for dithering
+        uint32_t    cFramesDropped;     // complete frames replaced by a newer one before being shown
+        uint32_t    usEncode;           // total time copying and color correcting into displayMemory
+        uint32_t    usShow;             // total time in OctoWS2811::show()
+        uint32_t    usShowMax;
+        uint32_t    usIngest;           // total time reading pixel protocols (OPC, DMX, DDP)
+        uint32_t    rgLatency[cLatencyBuckets];
+        uint32_t    cDatagramsLate;     // UDP datagrams dropped for arriving after a newer one
+    };
+
+    extern second_t last;
+
+    void setup();
+    void loop();
+
+    void frameStarted();
+    void frameCompleted(bool fDropped);
+    void frameShown(bool fRefresh, uint32_t usEncode, uint32_t usShow);
+    void ingestTime(uint32_t us);
+    void datagramLate();
+
+    // Writes Stats::last as JSON, returns the length
+    size_t format_json(char *sz, size_t cb);
+
+}
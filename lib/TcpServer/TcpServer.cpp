@@ -6,11 +6,14 @@
 #include <Persist.h>
 #include <MacAddress.h>
 #include <OpenPixelControl.h>
+#include <Dmx.h>
+#include <Ddp.h>
 #include <WebServer.h>
 #include <Ota.h>
 #include <Mqtt.h>
 #include <Logger.h>
 #include <WebSocket.h>
+#include <Stats.h>
 
 // Include Teensy41_AsyncTCP.h to link implementation of AsyncTCP
 #include "Teensy41_AsyncTCP.h"
@@ -37,18 +40,18 @@ namespace TcpServer
 
         uint8_t mac[6];
         Ethernet.macAddress(mac); // This is informative; it retrieves, not sets
-        Logger.printf("MAC = %02x:%02x:%02x:%02x:%02x:%02x\r\n",
+        LOG_INFO(NET, "MAC = %02x:%02x:%02x:%02x:%02x:%02x",
                       mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 
         // Listen for link changes
         Ethernet.onLinkState([](bool state)
                              {
             if (state) {
-            Logger.printf("[Ethernet] Link ON, %d Mbps, %s duplex\r\n",
+            LOG_INFO(NET, "Link ON, %d Mbps, %s duplex",
                     Ethernet.linkSpeed(),
                     Ethernet.linkIsFullDuplex() ? "Full" : "Half");
             } else {
-            Logger.println("[Ethernet] Link OFF\r\n");
+            LOG_INFO(NET, "Link OFF");
             }
             networkChanged(Ethernet.localIP() != IPAddress((uint32_t)0), state); });
 
@@ -62,17 +65,17 @@ namespace TcpServer
             IPAddress gw = Ethernet.gatewayIP();
             IPAddress dns = Ethernet.dnsServerIP();
 
-            Logger.printf("[Ethernet] Address changed:\r\n"
+            LOG_INFO(NET, "Address changed:\r\n"
                     "    Local IP = %u.%u.%u.%u\r\n"
                     "    Subnet   = %u.%u.%u.%u\r\n"
                     "    Gateway  = %u.%u.%u.%u\r\n"
-                    "    DNS      = %u.%u.%u.%u\r\n",
+                    "    DNS      = %u.%u.%u.%u",
                     ip[0], ip[1], ip[2], ip[3],
                     subnet[0], subnet[1], subnet[2], subnet[3],
                     gw[0], gw[1], gw[2], gw[3],
                     dns[0], dns[1], dns[2], dns[3]);
             } else {
-            Logger.println("[Ethernet] Address changed: No IP address");
+            LOG_INFO(NET, "Address changed: No IP address");
             }
 
             // Tell interested parties the network state, for example, servers,
@@ -94,19 +97,19 @@ namespace TcpServer
                               Persist::data.gateway[1],
                               Persist::data.gateway[2],
                               Persist::data.gateway[3]);
-            Logger.println("Starting Ethernet with static IP address...");
+            LOG_INFO(NET, "Starting Ethernet with static IP address...");
             if (!Ethernet.begin(ip, mask, gateway))
             {
-                Logger.println("Failed to start Ethernet");
+                LOG_ERROR(NET, "Failed to start Ethernet");
                 return;
             }
         }
         else
         {
-            Logger.println("Starting Ethernet with DHCP...");
+            LOG_INFO(NET, "Starting Ethernet with DHCP...");
             if (!Ethernet.begin())
             {
-                Logger.println("Failed to start Ethernet");
+                LOG_ERROR(NET, "Failed to start Ethernet");
                 return;
             }
         }
@@ -123,26 +126,42 @@ namespace TcpServer
         // Start the server and keep it up
         if (status != ready)
         {
-            Logger.println("Starting OPC and web servers");
+            LOG_INFO(NET, "Starting OPC, DMX, DDP, web servers and MQTT");
             OpenPixelControl::setup();
+            Dmx::setup();
+            Ddp::setup();
             WebServer::setup();
             // Ota::setup();
-            // Mqtt::setup();
+            Mqtt::setup();
             WebSocket::setup();
             status = ready;
         }
     }
 
-    void loop()
+    // The pixel protocols are scheduled separately from the rest, so that
+    // they can run as often as possible.
+    void loopPixels()
     {
 
         if (status != ready)
             return;
 
+        uint32_t usStart = micros();
         OpenPixelControl::loop();
+        Dmx::loop();
+        Ddp::loop();
+        Stats::ingestTime(micros() - usStart);
+    }
+
+    void loop()
+    {
+
+        if (status != ready)
+            return;
+
         WebServer::loop();
         // Ota::loop();
-        // Mqtt::loop();
+        Mqtt::loop();
         WebSocket::loop();
 
         Ethernet.maintain();
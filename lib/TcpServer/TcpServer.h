@@ -9,6 +9,7 @@ namespace TcpServer {
 
     void setup();
     void loop();
+    void loopPixels();
 
     bool initialized();
     void networkChanged(bool hasIP, bool linkState);
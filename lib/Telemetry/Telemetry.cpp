@@ -0,0 +1,73 @@
+#include <Telemetry.h>
+#include <Mqtt.h>
+#include <Imu.h>
+#include <Relay.h>
+#include <Stats.h>
+
+namespace Telemetry {
+
+    char szTopic[40];                           // "<client ID>/telemetry"
+
+    //                                              topic                   per second  minimum change
+    Mqtt::RateLimitedMqttPublisher<uint32_t> fps(   "fps",                  1.0);
+    Mqtt::RateLimitedMqttPublisher<float> heading(  "imu/heading",          4.0,        0.5);
+    Mqtt::RateLimitedMqttPublisher<float> roll(     "imu/roll",             4.0,        0.5);
+    Mqtt::RateLimitedMqttPublisher<float> pitch(    "imu/pitch",            4.0,        0.5);
+    Mqtt::RateLimitedMqttPublisher<float> head(     "imu/head_orientation", 4.0,        0.5);
+    Mqtt::RateLimitedMqttPublisher<bool> relay(     "relay/is_open",        4.0);
+    Mqtt::RateLimitedMqttPublisher<uint32_t> encode("timing/encode_us",     0.2,        100);
+    Mqtt::RateLimitedMqttPublisher<uint32_t> show(  "timing/show_us",       0.2,        100);
+    Mqtt::RateLimitedMqttPublisher<uint32_t> showMax("timing/show_max_us",  0.2,        10);
+    Mqtt::RateLimitedMqttPublisher<uint32_t> ingest("timing/ingest_us",     0.2,        100);
+
+    char szPayload[Mqtt::cbPayloadMax];
+    size_t cbPayload = 0;
+
+    // Adds a metric to the payload if it's due. A metric that doesn't fit
+    // is left for the next interval.
+    template <typename T>
+    void append(Mqtt::RateLimitedMqttPublisher<T> &metric, T value) {
+
+        char szValue[24];
+        size_t cbValue = Mqtt::format_value(szValue, sizeof(szValue), value);
+        size_t cbNeeded = strlen(metric.topic()) + cbValue + 4;    // separator, quotes and colon
+
+        // leave room for the closing brace
+        if (cbPayload + cbNeeded + 1 >= sizeof(szPayload) || !metric.due(value))
+            return;
+
+        cbPayload += snprintf(szPayload + cbPayload, sizeof(szPayload) - cbPayload, "%c\"%s\":%s",
+                              cbPayload == 0 ? '{' : ',', metric.topic(), szValue);
+    }
+
+    void loop() {
+
+        if (!Mqtt::connected())
+            return;
+
+        if (szTopic[0] == 0)
+            snprintf(szTopic, sizeof(szTopic), "%s/telemetry", Mqtt::client_id());
+
+        Imu::sample_t imu;
+        Imu::read(imu);
+
+        cbPayload = 0;
+        append(fps, Stats::last.cFramesShown);
+        append(heading, imu.orientation_x);
+        append(roll, imu.orientation_y);
+        append(pitch, imu.orientation_z);
+        append(head, imu.head_orientation);
+        append(relay, Relay.is_open());
+        append(encode, Stats::last.usEncode);
+        append(show, Stats::last.usShow);
+        append(showMax, Stats::last.usShowMax);
+        append(ingest, Stats::last.usIngest);
+
+        if (cbPayload == 0)
+            return;
+
+        cbPayload += snprintf(szPayload + cbPayload, sizeof(szPayload) - cbPayload, "}");
+        Mqtt::publish(szTopic, (const uint8_t *)szPayload, cbPayload);
+    }
+
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+// Publishes controller telemetry to MQTT for the fleet dashboard
+//
+// Every interval, the metrics that have changed enough since they were last
+// published, and whose own rate limit allows it, are batched into a single
+// JSON object on the "<client ID>/telemetry" topic (see Mqtt.h), e.g.
+//
+//      {"fps":60,"imu/heading":181.25,"relay/is_open":1}
+//
+// Nothing is published if nothing has changed. Values that are left out
+// have not changed since the previous message that contained them.
+//
+
+#include <Arduino.h>
+
+namespace Telemetry {
+
+    const uint32_t usInterval = 250000;         // how often Telemetry::loop() should be scheduled
+
+    void loop();
+
+}
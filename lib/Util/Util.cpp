@@ -4,8 +4,8 @@
 #include <Util.h>
 
 // better debugging. Inspired from https://gist.github.com/asheeshr/9004783 with some modifications
-
-#define DEBUG
+//
+// DEBUG comes from the debug build's flags in platformio.ini.
 
 namespace Util {
 
@@ -6,6 +6,11 @@
 #include <Logger.h>
 #include <Imu.h>
 #include <Relay.h>
+#include <Dmx.h>
+#include <Stats.h>
+#include <Scheduler.h>
+#include <Profiler.h>
+#include <Mqtt.h>
 
 #include <QNEthernet.h>
 using namespace qindesign::network;
@@ -39,9 +44,20 @@ namespace WebServer
                 Persist::data.ip_addr[2] = request->arg(i).toInt();
             if (request->argName(i) == "i3")
                 Persist::data.ip_addr[3] = request->arg(i).toInt();
+            if (request->argName(i) == "m0")
+                Persist::data.mqtt_broker[0] = request->arg(i).toInt();
+            if (request->argName(i) == "m1")
+                Persist::data.mqtt_broker[1] = request->arg(i).toInt();
+            if (request->argName(i) == "m2")
+                Persist::data.mqtt_broker[2] = request->arg(i).toInt();
+            if (request->argName(i) == "m3")
+                Persist::data.mqtt_broker[3] = request->arg(i).toInt();
+            if (request->argName(i) == "mp")
+                Persist::data.mqtt_port = request->arg(i).toInt();
         }
-        Persist::write();
+        Persist::mark_dirty();
         LED::load_persistant_data();
+        Mqtt::load_persistant_data();
     }
 
     void handleRoot(AsyncWebServerRequest *request)
@@ -68,6 +84,13 @@ namespace WebServer
                  "<input name=i1 size=3 value=%d>."
                  "<input name=i2 size=3 value=%d>."
                  "<input name=i3 size=3 value=%d>"
+                 "<br>"
+                 "MQTT broker (0.0.0.0 = off): "
+                 "<input name=m0 size=3 value=%d>."
+                 "<input name=m1 size=3 value=%d>."
+                 "<input name=m2 size=3 value=%d>."
+                 "<input name=m3 size=3 value=%d>:"
+                 "<input name=mp size=5 value=%d>"
                  "<br / >"
                  "<input type=submit>"
                  "<br>"
@@ -83,7 +106,12 @@ namespace WebServer
                  Persist::data.ip_addr[0],
                  Persist::data.ip_addr[1],
                  Persist::data.ip_addr[2],
-                 Persist::data.ip_addr[3]);
+                 Persist::data.ip_addr[3],
+                 Persist::data.mqtt_broker[0],
+                 Persist::data.mqtt_broker[1],
+                 Persist::data.mqtt_broker[2],
+                 Persist::data.mqtt_broker[3],
+                 Persist::data.mqtt_port);
 
         request->send(200, "text/html", temp);
     }
@@ -101,6 +129,72 @@ namespace WebServer
         request->send(200, "text/plain", String("{ \"" + field + "\": \"" + String(value) + "\"}"));
     }
 
+    void handleDmxMapJson(AsyncWebServerRequest *request)
+    {
+        JsonDocument obj;
+        JsonArray map = obj["map"].to<JsonArray>();
+        for (int i = 0; i < DMX_MAX_UNIVERSES; i++)
+        {
+            const Persist::dmx_universe_t &entry = Persist::data.dmx_map[i];
+            if (entry.universe == 0)
+                continue;
+            JsonArray item = map.add<JsonArray>();
+            item.add(entry.universe);
+            item.add(entry.strip);
+            item.add(entry.pixel);
+        }
+
+        char temp[BUFFER_SIZE];
+        serializeJson(obj, temp, sizeof(temp));
+        request->send(200, "text/plain", temp);
+    }
+
+    void handleStripsJson(AsyncWebServerRequest *request)
+    {
+        JsonDocument obj;
+        JsonArray length = obj["length"].to<JsonArray>();
+        JsonArray enabled = obj["enabled"].to<JsonArray>();
+        for (int i = 0; i < NUM_STRIPS; i++)
+        {
+            length.add(Persist::data.strip_length[i]);
+            enabled.add(Persist::data.strip_enabled[i]);
+        }
+
+        char temp[BUFFER_SIZE];
+        serializeJson(obj, temp, sizeof(temp));
+        request->send(200, "text/plain", temp);
+    }
+
+    void handleColorJson(AsyncWebServerRequest *request)
+    {
+        JsonDocument obj;
+        obj["gamma"] = Persist::data.gamma;
+        obj["brightness"] = Persist::data.brightness;
+        JsonArray white = obj["white"].to<JsonArray>();
+        for (int i = 0; i < 3; i++)
+            white.add(Persist::data.white_point[i]);
+        obj["dither"] = Persist::data.dither;
+
+        char temp[BUFFER_SIZE];
+        serializeJson(obj, temp, sizeof(temp));
+        request->send(200, "text/plain", temp);
+    }
+
+    // { "levels": { "OPC": "info", ... }, "compiled": "debug", "dropped": 0 }
+    void handleLogJson(AsyncWebServerRequest *request)
+    {
+        JsonDocument obj;
+        JsonObject levels = obj["levels"].to<JsonObject>();
+        for (int i = 0; i < cLogModules; i++)
+            levels[rgszLogModules[i]] = rgszLogLevels[rgLogLevel[i]];
+        obj["compiled"] = rgszLogLevels[LOG_LEVEL];
+        obj["dropped"] = Logger.dropped();
+
+        char temp[BUFFER_SIZE];
+        serializeJson(obj, temp, sizeof(temp));
+        request->send(200, "text/plain", temp);
+    }
+
     void setup()
     {
         server.begin();
@@ -125,7 +219,10 @@ namespace WebServer
                   { LED::setSolidColor(WHITE); 
                         request->redirect("/"); });
         server.on("/head_orientation", HTTP_GET, [](AsyncWebServerRequest *request)
-                  { handleFloatResponseJson(request, "orientation", Imu::head_orientation); });
+                  {
+                    Imu::sample_t imu;
+                    Imu::read(imu);
+                    handleFloatResponseJson(request, "orientation", imu.head_orientation); });
         server.on("/relay", HTTP_GET, [](AsyncWebServerRequest *request)
                   { handleBoolResponseJson(request, "is_open", Relay.is_open()); });
         server.on("/relay", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
@@ -134,8 +231,7 @@ namespace WebServer
                     DeserializationError error = deserializeJson(obj, (const char *)data, len);
                     if (error)
                     {
-                        Logger.print(F("/relay failed: "));
-                        Logger.println(error.c_str());
+                        LOG_WARN(NET, "/relay failed: %s", error.c_str());
                         return;
                     }
                     if(obj["open"] == "true") {
@@ -146,9 +242,135 @@ namespace WebServer
                     }
                     });
 
+        server.on("/dmx", HTTP_GET, [](AsyncWebServerRequest *request)
+                  { handleDmxMapJson(request); });
+        // body is { "map": [ [universe, strip, pixel], ... ] }
+        server.on("/dmx", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+                  {
+                    JsonDocument obj;
+                    DeserializationError error = deserializeJson(obj, (const char *)data, len);
+                    if (error)
+                    {
+                        LOG_WARN(NET, "/dmx failed: %s", error.c_str());
+                        return;
+                    }
+                    JsonArray map = obj["map"];
+                    memset(Persist::data.dmx_map, 0, sizeof(Persist::data.dmx_map));
+                    int i = 0;
+                    for (JsonArray item : map)
+                    {
+                        if (i >= DMX_MAX_UNIVERSES)
+                            break;
+                        Persist::data.dmx_map[i].universe = item[0];
+                        Persist::data.dmx_map[i].strip = item[1];
+                        Persist::data.dmx_map[i].pixel = item[2];
+                        i++;
+                    }
+                    Persist::mark_dirty();
+                    Dmx::load_persistant_data();
+                    handleDmxMapJson(request);
+                    });
+
+        server.on("/strips", HTTP_GET, [](AsyncWebServerRequest *request)
+                  { handleStripsJson(request); });
+        // body is { "length": [550, 180, ...], "enabled": [true, false, ...] }, one per output
+        server.on("/strips", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+                  {
+                    JsonDocument obj;
+                    DeserializationError error = deserializeJson(obj, (const char *)data, len);
+                    if (error)
+                    {
+                        LOG_WARN(NET, "/strips failed: %s", error.c_str());
+                        return;
+                    }
+                    for (int i = 0; i < NUM_STRIPS; i++)
+                    {
+                        if (obj["length"][i].is<int>())
+                            Persist::data.strip_length[i] = constrain(obj["length"][i].as<int>(), 0, LEDS_PER_STRIP);
+                        if (obj["enabled"][i].is<bool>())
+                            Persist::data.strip_enabled[i] = obj["enabled"][i];
+                    }
+                    Persist::mark_dirty();
+                    LED::load_persistant_data();
+                    handleStripsJson(request);
+                    });
+
+        server.on("/color", HTTP_GET, [](AsyncWebServerRequest *request)
+                  { handleColorJson(request); });
+        // body is { "gamma": 2.5, "brightness": 32, "white": [255, 240, 220], "dither": true }, all optional
+        server.on("/color", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+                  {
+                    JsonDocument obj;
+                    DeserializationError error = deserializeJson(obj, (const char *)data, len);
+                    if (error)
+                    {
+                        LOG_WARN(NET, "/color failed: %s", error.c_str());
+                        return;
+                    }
+                    if (obj["gamma"].is<float>())
+                        Persist::data.gamma = obj["gamma"];
+                    if (obj["brightness"].is<int>())
+                        Persist::data.brightness = constrain(obj["brightness"].as<int>(), 0, 255);
+                    for (int i = 0; i < 3; i++)
+                    {
+                        if (obj["white"][i].is<int>())
+                            Persist::data.white_point[i] = constrain(obj["white"][i].as<int>(), 0, 255);
+                    }
+                    if (obj["dither"].is<bool>())
+                        Persist::data.dither = obj["dither"];
+                    Persist::mark_dirty();
+                    LED::load_persistant_data();
+                    handleColorJson(request);
+                    });
+
+        server.on("/log", HTTP_GET, [](AsyncWebServerRequest *request)
+                  { handleLogJson(request); });
+        // body is { "OPC": "debug", "NET": "warn" }, any modules. Levels above the one
+        // compiled in have no effect.
+        server.on("/log", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+                  {
+                    JsonDocument obj;
+                    DeserializationError error = deserializeJson(obj, (const char *)data, len);
+                    if (error)
+                    {
+                        LOG_WARN(NET, "/log failed: %s", error.c_str());
+                        return;
+                    }
+                    for (int i = 0; i < cLogModules; i++)
+                    {
+                        const char *szLevel = obj[rgszLogModules[i]];
+                        for (int level = 0; szLevel && level <= LOG_LEVEL_DEBUG; level++)
+                        {
+                            if (strcmp(szLevel, rgszLogLevels[level]) == 0)
+                                rgLogLevel[i] = level;
+                        }
+                    }
+                    handleLogJson(request);
+                    });
+
+        server.on("/stats", HTTP_GET, [](AsyncWebServerRequest *request)
+                  {
+                    char temp[BUFFER_SIZE];
+                    Stats::format_json(temp, sizeof(temp));
+                    request->send(200, "text/plain", temp); });
+
+        server.on("/scheduler", HTTP_GET, [](AsyncWebServerRequest *request)
+                  {
+                    char temp[BUFFER_SIZE];
+                    Scheduler::format_json(temp, sizeof(temp));
+                    request->send(200, "text/plain", temp); });
+
+        server.on("/profile", HTTP_GET, [](AsyncWebServerRequest *request)
+                  {
+                    if (request->hasArg("reset"))
+                        Profiler::reset();
+                    char temp[4 * BUFFER_SIZE];
+                    Profiler::format_json(temp, sizeof(temp));
+                    request->send(200, "text/plain", temp); });
+
         server.onNotFound(notFound);
         server.begin();
-        Logger.println("Webserver ready");
+        LOG_INFO(NET, "Webserver ready");
     }
 
     void loop()
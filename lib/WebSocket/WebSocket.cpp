@@ -3,6 +3,10 @@
 #include <Logger.h>
 #include <Imu.h>
 #include <Relay.h>
+#include <Stats.h>
+#include <Profiler.h>
+#include <LED.h>
+#include <OpenPixelControl.h>
 
 #if (defined(CORE_TEENSY) && defined(__IMXRT1062__) && defined(ARDUINO_TEENSY41))
 // For Teensy 4.1
@@ -26,92 +30,574 @@
 
 using namespace websockets2_generic;
 
+
 namespace WebSocket
 {
 
-    // Define how many clients we accept simultaneously.
-    const byte maxClients = 16;
+    // Define how many clients we accept simultaneously. Only connected
+    // clients cost anything in the loop, so this can be raised freely as
+    // long as there is memory for them.
+    const uint16_t maxClients = 16;
 
     WebsocketsClient clients[maxClients];
     WebsocketsServer server;
 
-    void setup()
+    // Slots in use, in no particular order, and a stack of the free ones
+    uint16_t rgActiveClients[maxClients];
+    uint16_t cActiveClients = 0;
+    uint16_t rgFreeClients[maxClients];
+    uint16_t cFreeClients = 0;
+
+    // Everything a handler needs to know about one request
+    struct request_t
     {
-        // Start websockets server.
-        server.listen(WEBSOCKET_PORT);
+        WebsocketsClient &client;
+        int ix;                     // index of the client
+        bool fText;                 // reply with text rather than a binary message
+        uint8_t field;              // text: which value the command asks for
+        const uint8_t *pbArgs;      // binary: the bytes after the opcode
+        size_t cbArgs;
+        const char *szArgs;         // text: whatever follows the command
+    };
 
-        if (server.available())
+    typedef bool (*handler_t)(request_t &request);
+
+    //
+    // IMU history and streaming
+    //
+    // The records are copied in right behind an opcode byte, so the same
+    // buffer can be sent with the opcode (binary protocol) or without it
+    // (text protocol).
+    //
+    enum ImuStream : uint8_t { streamOff, streamText, streamBinary };
+
+    struct __attribute__((packed)) history_reply_t
+    {
+        uint8_t opcode;
+        Imu::record_t records[Imu::cHistory];
+    };
+
+    uint8_t rgImuStream[maxClients];
+    uint32_t rgImuSequenceSent[maxClients];
+    history_reply_t historyReply = { opImuHistory };
+
+    // Sends every IMU record after seqAfter as one binary message,
+    // returns the sequence number of the last one sent
+    uint32_t sendImuHistory(WebsocketsClient &client, uint32_t seqAfter, bool fText)
+    {
+        size_t cRecords = Imu::copy_history(seqAfter, historyReply.records, Imu::cHistory);
+        if (cRecords == 0)
+            return seqAfter;
+
+        if (fText)
+            client.sendBinary((const char *)historyReply.records, cRecords * sizeof(Imu::record_t));
+        else
+            client.sendBinary((const char *)&historyReply, 1 + cRecords * sizeof(Imu::record_t));
+        return historyReply.records[cRecords - 1].sequence;
+    }
+
+    //
+    // Telemetry subscriptions
+    //
+    // Every value a client could poll for is also a topic it can subscribe
+    // to. A subscribed client gets one message per period holding all of
+    // its topics, e.g. {"imu/head_orientation":12.50,"relay/is_open":0}.
+    // Each distinct set of topics is serialized at most once per tick, however
+    // many clients ask for it.
+    //
+    const char *rgszTopics[cTopics] = {
+        "imu/orientation_x",
+        "imu/orientation_y",
+        "imu/orientation_z",
+        "imu/head_orientation",
+        "imu/calibration_sys",
+        "imu/calibration_gyro",
+        "imu/calibration_accel",
+        "imu/calibration_mag",
+        "imu/timestamp",
+        "relay/is_open",
+        "stats/fps",
+    };
+
+    const uint32_t maskAllTopics = (1 << cTopics) - 1;
+    const uint32_t hzSubscriptionMax = 100;
+
+    uint32_t rgTopicMask[maxClients];           // 0: not subscribed
+    bool rgfTelemetryText[maxClients];
+    uint32_t rgUsPeriod[maxClients];
+    uint32_t rgUsLastSent[maxClients];
+
+    // Frames serialized during the current tick, by topic mask and format
+    const int cCachedFrames = 4;
+    const size_t cbFrame = 512;
+
+    struct frame_t {
+        uint32_t mask;
+        bool fText;
+        size_t cb;
+        char sz[cbFrame];
+    };
+
+    frame_t rgFrames[cCachedFrames];
+    int cFramesCached = 0;
+
+    int find_topic(const char *szTopic, size_t cch)
+    {
+        for (int i = 0; i < cTopics; i++)
         {
-            Logger.print("Server available at ws://");
-            Logger.print(Ethernet.localIP());
-            Logger.printf(":%d", WEBSOCKET_PORT);
-            Logger.println();
+            if (strlen(rgszTopics[i]) == cch && strncmp(rgszTopics[i], szTopic, cch) == 0)
+                return i;
         }
-        else
+        return -1;
+    }
+
+    size_t format_topic(int topic, const Imu::sample_t &imu, char *sz, size_t cb)
+    {
+        switch (topic)
         {
-            Logger.println("Server not available!");
+        case topicOrientationX:     return snprintf(sz, cb, "%.2f", imu.orientation_x);
+        case topicOrientationY:     return snprintf(sz, cb, "%.2f", imu.orientation_y);
+        case topicOrientationZ:     return snprintf(sz, cb, "%.2f", imu.orientation_z);
+        case topicHeadOrientation:  return snprintf(sz, cb, "%.2f", imu.head_orientation);
+        case topicCalibrationSys:   return snprintf(sz, cb, "%u", imu.calibration_sys);
+        case topicCalibrationGyro:  return snprintf(sz, cb, "%u", imu.calibration_gyro);
+        case topicCalibrationAccel: return snprintf(sz, cb, "%u", imu.calibration_accel);
+        case topicCalibrationMag:   return snprintf(sz, cb, "%u", imu.calibration_mag);
+        case topicImuTimestamp:     return snprintf(sz, cb, "%lu", imu.timestamp);
+        case topicRelayIsOpen:      return snprintf(sz, cb, "%d", Relay.is_open());
+        case topicFps:              return snprintf(sz, cb, "%lu", Stats::last.cFramesShown);
         }
+        return 0;
     }
 
-    void handleMessage(WebsocketsClient &client, WebsocketsMessage message)
+    // The 4 byte value of a topic in an opTelemetry message
+    void encode_topic(int topic, const Imu::sample_t &imu, char *pb)
     {
-        auto data = message.data();
-        if (data == "imu/orientation_x")
+        float f = 0;
+        uint32_t u = 0;
+
+        switch (topic)
         {
-            client.send(String(Imu::orientation_x).c_str());
+        case topicOrientationX:     f = imu.orientation_x; break;
+        case topicOrientationY:     f = imu.orientation_y; break;
+        case topicOrientationZ:     f = imu.orientation_z; break;
+        case topicHeadOrientation:  f = imu.head_orientation; break;
+        case topicCalibrationSys:   u = imu.calibration_sys; break;
+        case topicCalibrationGyro:  u = imu.calibration_gyro; break;
+        case topicCalibrationAccel: u = imu.calibration_accel; break;
+        case topicCalibrationMag:   u = imu.calibration_mag; break;
+        case topicImuTimestamp:     u = imu.timestamp; break;
+        case topicRelayIsOpen:      u = Relay.is_open(); break;
+        case topicFps:              u = Stats::last.cFramesShown; break;
         }
-        else if (data == "imu/orientation_y")
+
+        if (topic <= topicHeadOrientation)
+            memcpy(pb, &f, sizeof(f));
+        else
+            memcpy(pb, &u, sizeof(u));
+    }
+
+    // Serializes every topic in mask as one JSON object, or one opTelemetry message
+    void format_frame(uint32_t mask, bool fText, const Imu::sample_t &imu, frame_t &frame)
+    {
+        size_t cb = 0;
+        char chSeparator = '{';
+
+        frame.mask = mask;
+        frame.fText = fText;
+
+        if (!fText)
         {
-            client.send(String(Imu::orientation_y).c_str());
+            frame.sz[cb++] = opTelemetry;
+            memcpy(frame.sz + cb, &mask, sizeof(mask));
+            cb += sizeof(mask);
+
+            for (int i = 0; i < cTopics; i++)
+            {
+                if ((mask >> i) & 1)
+                {
+                    encode_topic(i, imu, frame.sz + cb);
+                    cb += 4;
+                }
+            }
+
+            frame.cb = cb;
+            return;
         }
-        else if (data == "imu/orientation_z")
+
+        for (int i = 0; i < cTopics && cb < cbFrame; i++)
         {
-            client.send(String(Imu::orientation_z).c_str());
+            if (!((mask >> i) & 1))
+                continue;
+
+            cb += snprintf(frame.sz + cb, cbFrame - cb, "%c\"%s\":", chSeparator, rgszTopics[i]);
+            if (cb < cbFrame)
+                cb += format_topic(i, imu, frame.sz + cb, cbFrame - cb);
+            chSeparator = ',';
         }
-        else if (data == "imu/head_orientation")
+
+        if (cb < cbFrame)
+            cb += snprintf(frame.sz + cb, cbFrame - cb, "}");
+
+        frame.cb = min(cb, cbFrame - 1);
+    }
+
+    void subscribe(int ix, uint32_t hz, uint32_t mask, bool fText)
+    {
+        rgTopicMask[ix] = mask;
+        rgfTelemetryText[ix] = fText;
+        rgUsPeriod[ix] = 1000000 / min(hz, hzSubscriptionMax);
+        rgUsLastSent[ix] = micros() - rgUsPeriod[ix];
+    }
+
+    // Parses "<hz> <topic> <topic> ..."
+    bool parse_subscription(const char *sz, uint32_t &hz, uint32_t &mask)
+    {
+        char *szEnd;
+        hz = strtoul(sz, &szEnd, 10);
+        if (szEnd == sz || hz == 0)
+            return false;
+
+        mask = 0;
+        for (sz = szEnd; *sz; )
         {
-            client.send(String(Imu::head_orientation).c_str());
+            while (*sz == ' ')
+                sz++;
+            size_t cch = strcspn(sz, " ");
+            if (cch == 0)
+                break;
+
+            int topic = find_topic(sz, cch);
+            if (topic < 0)
+                return false;
+
+            mask |= (1 << topic);
+            sz += cch;
         }
-        else if (data == "imu/calibration_sys")
+
+        return mask != 0;
+    }
+
+    void send_reply(request_t &request, const void *pv, size_t cb)
+    {
+        request.client.sendBinary((const char *)pv, cb);
+    }
+
+    void send_text(request_t &request, const char *sz, size_t cb)
+    {
+        request.client.send(sz, cb);
+    }
+
+    //
+    // Handlers, in opcode order
+    //
+
+    bool onImu(request_t &request)
+    {
+        Imu::sample_t imu;
+        Imu::read(imu);
+
+        if (request.fText)
         {
-            client.send(String(Imu::calibration_sys).c_str());
+            char sz[32];
+            size_t cb = format_topic(request.field, imu, sz, sizeof(sz));
+            send_text(request, sz, min(cb, sizeof(sz) - 1));
+            return true;
         }
-        else if (data == "imu/calibration_gyro")
+
+        imu_reply_t reply;
+        reply.opcode = opImu;
+        reply.timestamp = imu.timestamp;
+        reply.orientation[0] = imu.orientation_x;
+        reply.orientation[1] = imu.orientation_y;
+        reply.orientation[2] = imu.orientation_z;
+        reply.head_orientation = imu.head_orientation;
+        reply.calibration[0] = imu.calibration_sys;
+        reply.calibration[1] = imu.calibration_gyro;
+        reply.calibration[2] = imu.calibration_accel;
+        reply.calibration[3] = imu.calibration_mag;
+        send_reply(request, &reply, sizeof(reply));
+        return true;
+    }
+
+    bool onImuHistory(request_t &request)
+    {
+        // the last N samples, oldest first
+        uint32_t cSamples;
+        if (request.fText)
+            cSamples = strtoul(request.szArgs, NULL, 10);
+        else if (request.cbArgs >= 2)
+            cSamples = request.pbArgs[0] | (request.pbArgs[1] << 8);
+        else
+            return false;
+
+        // shortly after boot there are fewer than that
+        uint32_t seqLatest = Imu::latest_sequence();
+        cSamples = min(cSamples, min(Imu::cHistory, seqLatest));
+        sendImuHistory(request.client, seqLatest - cSamples, request.fText);
+        return true;
+    }
+
+    bool onImuStream(request_t &request)
+    {
+        bool fOn;
+        if (request.fText)
+            fOn = request.field;
+        else if (request.cbArgs >= 1)
+            fOn = request.pbArgs[0];
+        else
+            return false;
+
+        rgImuStream[request.ix] = !fOn ? streamOff : request.fText ? streamText : streamBinary;
+        rgImuSequenceSent[request.ix] = Imu::latest_sequence();
+        return true;
+    }
+
+    bool onRelayOpen(request_t &request)
+    {
+        Relay.open();
+        return true;
+    }
+
+    bool onRelayClose(request_t &request)
+    {
+        Relay.close();
+        return true;
+    }
+
+    bool onRelayStatus(request_t &request)
+    {
+        if (request.fText)
         {
-            client.send(String(Imu::calibration_gyro).c_str());
+            // field 0 asks whether it's open, 1 whether it's closed
+            send_text(request, (request.field ? Relay.is_closed() : Relay.is_open()) ? "1" : "0", 1);
+            return true;
         }
-        else if (data == "imu/calibration_accel")
+
+        relay_reply_t reply = { opRelayStatus, Relay.is_open() };
+        send_reply(request, &reply, sizeof(reply));
+        return true;
+    }
+
+    bool onStats(request_t &request)
+    {
+        if (request.fText)
         {
-            client.send(String(Imu::calibration_accel).c_str());
+            char temp[512];
+            size_t cb = Stats::format_json(temp, sizeof(temp));
+            send_text(request, temp, min(cb, sizeof(temp) - 1));
+            return true;
         }
-        else if (data == "imu/calibration_mag")
+
+        stats_reply_t reply;
+        reply.opcode = opStats;
+        reply.second = Stats::last;
+        send_reply(request, &reply, sizeof(reply));
+        return true;
+    }
+
+    bool onSubscribe(request_t &request)
+    {
+        uint32_t hz, mask;
+        if (request.fText)
         {
-            client.send(String(Imu::calibration_mag).c_str());
+            if (!parse_subscription(request.szArgs, hz, mask))
+                return false;
         }
-        else if (data == "imu/timestamp")
+        else
         {
-            client.send(String(Imu::timestamp).c_str());
+            if (request.cbArgs < 5)
+                return false;
+            hz = request.pbArgs[0];
+            memcpy(&mask, request.pbArgs + 1, sizeof(mask));
+            mask &= maskAllTopics;
+            if (hz == 0 || mask == 0)
+                return false;
         }
-        else if (data == "relay/open")
+
+        subscribe(request.ix, hz, mask, request.fText);
+        return true;
+    }
+
+    bool onUnsubscribe(request_t &request)
+    {
+        rgTopicMask[request.ix] = 0;
+        return true;
+    }
+
+    //
+    // Pixel frames. Pixels from any client are treated as one source, which
+    // is connected for as long as frames keep arriving.
+    //
+    const uint32_t tmPixelTimeout = 2000;       // ms without a frame before we give up on the client
+
+    bool fPixelsActive = false;
+    uint32_t tmLastPixels = 0;
+
+    void pixelsActivity(bool f)
+    {
+        if (f)
+            tmLastPixels = millis();
+
+        if (f == fPixelsActive)
+            return;
+
+        LOG_INFO(NET, "WebSocket pixel client %s", f ? "connected" : "timed out");
+        LED::openPixelClientConnection(f);
+        fPixelsActive = f;
+    }
+
+    // pbArgs/cbArgs are the raw message, so pixel data may contain zeros
+    bool onPixels(request_t &request)
+    {
+        if (request.fText)
+            return false;
+
+        pixelsActivity(true);
+        if (OpenPixelControl::receive_messages(request.pbArgs, request.cbArgs))
+            LED::show();
+        return true;
+    }
+
+    bool onFrame(request_t &request)
+    {
+        if (request.fText || request.cbArgs == 0)
+            return false;
+
+        size_t cb = min(request.cbArgs, (size_t)(3 * NUM_STRIPS * LEDS_PER_STRIP));
+
+        pixelsActivity(true);
+        memcpy(OpenPixelControl::channel_buffer(0), request.pbArgs, cb);
+        LED::pixelsReceived(0, cb);
+        LED::show();
+        return true;
+    }
+
+    const handler_t rgHandlers[cOpcodes] = {
+        NULL,
+        onImu,                  // opImu
+        onImuHistory,           // opImuHistory
+        onImuStream,            // opImuStream
+        onRelayOpen,            // opRelayOpen
+        onRelayClose,           // opRelayClose
+        onRelayStatus,          // opRelayStatus
+        onStats,                // opStats
+        onSubscribe,            // opSubscribe
+        onUnsubscribe,          // opUnsubscribe
+        NULL,                   // opTelemetry
+        onPixels,               // opPixels
+        onFrame,                // opFrame
+    };
+
+    //
+    // The text protocol: each command is an opcode, plus the field it asks
+    // for. Commands that take arguments end in a space.
+    //
+    struct text_command_t
+    {
+        const char *szCommand;
+        uint8_t opcode;
+        uint8_t field;
+    };
+
+    const text_command_t rgTextCommands[] = {
+        { "imu/orientation_x",      opImu,          topicOrientationX },
+        { "imu/orientation_y",      opImu,          topicOrientationY },
+        { "imu/orientation_z",      opImu,          topicOrientationZ },
+        { "imu/head_orientation",   opImu,          topicHeadOrientation },
+        { "imu/calibration_sys",    opImu,          topicCalibrationSys },
+        { "imu/calibration_gyro",   opImu,          topicCalibrationGyro },
+        { "imu/calibration_accel",  opImu,          topicCalibrationAccel },
+        { "imu/calibration_mag",    opImu,          topicCalibrationMag },
+        { "imu/timestamp",          opImu,          topicImuTimestamp },
+        { "imu/history ",           opImuHistory,   0 },
+        { "imu/stream/on",          opImuStream,    1 },
+        { "imu/stream/off",         opImuStream,    0 },
+        { "relay/open",             opRelayOpen,    0 },
+        { "relay/close",            opRelayClose,   0 },
+        { "relay/is_open",          opRelayStatus,  0 },
+        { "relay/is_closed",        opRelayStatus,  1 },
+        { "stats",                  opStats,        0 },
+        { "subscribe ",             opSubscribe,    0 },
+        { "unsubscribe",            opUnsubscribe,  0 },
+    };
+
+    const text_command_t *find_text_command(const char *sz)
+    {
+        for (const text_command_t &command : rgTextCommands)
         {
-            Relay.open();
+            size_t cch = strlen(command.szCommand);
+            bool fArgs = command.szCommand[cch - 1] == ' ';
+
+            if (strncmp(sz, command.szCommand, cch) == 0 && (fArgs || sz[cch] == '\0'))
+                return &command;
         }
-        else if (data == "relay/close")
+        return NULL;
+    }
+
+    void setup()
+    {
+        cActiveClients = 0;
+        for (cFreeClients = 0; cFreeClients < maxClients; cFreeClients++)
+            rgFreeClients[cFreeClients] = maxClients - 1 - cFreeClients;
+
+        // Start websockets server.
+        server.listen(WEBSOCKET_PORT);
+
+        if (server.available())
         {
-            Relay.close();
+            IPAddress ip = Ethernet.localIP();
+            LOG_INFO(NET, "WebSocket server available at ws://%u.%u.%u.%u:%d", ip[0], ip[1], ip[2], ip[3], WEBSOCKET_PORT);
         }
-        else if (data == "relay/is_open")
+        else
         {
-            client.send(String(Relay.is_open()).c_str());
+            LOG_ERROR(NET, "WebSocket server not available!");
         }
-        else if (data == "relay/is_closed")
+    }
+
+    void handleMessage(WebsocketsClient &client, WebsocketsMessage message)
+    {
+        int ix = &client - clients;
+        if (ix < 0 || ix >= maxClients)
+            return;
+
+        // Not message.data(): that goes through a String built from c_str(),
+        // which cuts a binary message short at its first zero byte
+        const char *pch = message.c_str();
+        size_t cb = message.length();
+        request_t request = { client, ix, message.isText(), 0, NULL, 0, "" };
+        uint8_t opcode = 0;
+
+        if (request.fText)
         {
-            client.send(String(Relay.is_closed()).c_str());
+            const text_command_t *pcommand = find_text_command(pch);
+            if (pcommand)
+            {
+                opcode = pcommand->opcode;
+                request.field = pcommand->field;
+                request.szArgs = pch + strlen(pcommand->szCommand);
+            }
         }
-        else {
-            Serial.printf("Unknown WebSocket request: ");
-            Serial.println(data);
-            client.send(String("error"));
+        else if (cb > 0)
+        {
+            opcode = pch[0];
+            request.pbArgs = (const uint8_t *)pch + 1;
+            request.cbArgs = cb - 1;
+        }
+
+        handler_t handler = opcode < cOpcodes ? rgHandlers[opcode] : NULL;
+        if (handler && handler(request))
+            return;
+
+        if (request.fText)
+        {
+            LOG_WARN(NET, "Unknown WebSocket request: %s", pch);
+            client.send("error");
+        }
+        else
+        {
+            uint8_t rgError[2] = { opError, opcode };
+            client.sendBinary((const char *)rgError, sizeof(rgError));
         }
     }
 
@@ -119,52 +605,134 @@ namespace WebSocket
     {
         if (event == WebsocketsEvent::ConnectionClosed)
         {
-            Serial.println("Connection closed");
+            LOG_INFO(NET, "WebSocket connection closed");
         }
     }
 
-    int8_t getFreeClientIndex()
+    // Takes a slot off the free stack, returns -1 if there are none
+    int allocateClient()
     {
-        // If a client in our list is not available, it's connection is closed and we
-        // can use it for a new client.
-        for (byte i = 0; i < maxClients; i++)
-        {
-            if (!clients[i].available())
-                return i;
-        }
+        if (cFreeClients == 0)
+            return -1;
 
-        return -1;
+        uint16_t ix = rgFreeClients[--cFreeClients];
+        rgActiveClients[cActiveClients++] = ix;
+        return ix;
+    }
+
+    // Removes the ixActive'th active client, its slot goes back on the free stack
+    void releaseClient(uint16_t ixActive)
+    {
+        uint16_t ix = rgActiveClients[ixActive];
+
+        rgActiveClients[ixActive] = rgActiveClients[--cActiveClients];
+        rgFreeClients[cFreeClients++] = ix;
+        rgImuStream[ix] = streamOff;
+        rgTopicMask[ix] = 0;
+        LOG_DEBUG(NET, "Released websockets client at index %d", ix);
     }
 
     void listenForClients()
     {
         if (server.poll())
         {
-            int8_t freeIndex = getFreeClientIndex();
-
-            if (freeIndex >= 0)
+            if (cFreeClients > 0)
             {
                 WebsocketsClient newClient = server.accept();
                 if (newClient.available())
                 {
-                    Logger.printf("Accepted new websockets client at index %d\n", freeIndex);
+                    int ix = allocateClient();
+                    LOG_INFO(NET, "Accepted new websockets client at index %d", ix);
                     newClient.onMessage(handleMessage);
                     newClient.onEvent(handleEvent);
-                    clients[freeIndex] = newClient;
+                    clients[ix] = newClient;
+                    rgImuStream[ix] = streamOff;
+                    rgTopicMask[ix] = 0;
                 }
             }
             else
             {
-                Logger.printf("Exceeded the number of clients that are able to connect (%d)./n", maxClients);
+                LOG_WARN(NET, "Exceeded the number of clients that are able to connect (%d).", maxClients);
             }
         }
     }
 
+    Profiler::Probe probePollClients("WebSocket::pollClients");
+
+    // Only connected clients are polled; the library's poll() returns
+    // straight away unless the socket has data for us.
     void pollClients()
     {
-        for (byte i = 0; i < maxClients; i++)
+        Profiler::Scope scope(probePollClients);
+
+        for (uint16_t i = 0; i < cActiveClients; )
         {
-            clients[i].poll();
+            WebsocketsClient &client = clients[rgActiveClients[i]];
+            client.poll();
+
+            if (client.available())
+                i++;
+            else
+                releaseClient(i);
+        }
+    }
+
+    void streamImu()
+    {
+        uint32_t seqLatest = Imu::latest_sequence();
+
+        for (uint16_t ixActive = 0; ixActive < cActiveClients; ixActive++)
+        {
+            uint16_t i = rgActiveClients[ixActive];
+            if (rgImuStream[i] != streamOff && rgImuSequenceSent[i] != seqLatest)
+                rgImuSequenceSent[i] = sendImuHistory(clients[i], rgImuSequenceSent[i], rgImuStream[i] == streamText);
+        }
+    }
+
+    // Sends each subscriber whose period is up the frame for its topics
+    void publishTelemetry()
+    {
+        uint32_t usNow = micros();
+        bool fImuRead = false;
+        Imu::sample_t imu;
+        frame_t frameUncached;
+
+        cFramesCached = 0;
+
+        for (uint16_t ixActive = 0; ixActive < cActiveClients; ixActive++)
+        {
+            uint16_t i = rgActiveClients[ixActive];
+            if (rgTopicMask[i] == 0 || (usNow - rgUsLastSent[i]) < rgUsPeriod[i])
+                continue;
+
+            if (!fImuRead)
+            {
+                Imu::read(imu);
+                fImuRead = true;
+            }
+
+            frame_t *pframe = NULL;
+            for (int j = 0; j < cFramesCached && !pframe; j++)
+            {
+                if (rgFrames[j].mask == rgTopicMask[i] && rgFrames[j].fText == rgfTelemetryText[i])
+                    pframe = &rgFrames[j];
+            }
+
+            if (!pframe)
+            {
+                pframe = cFramesCached < cCachedFrames ? &rgFrames[cFramesCached++] : &frameUncached;
+                format_frame(rgTopicMask[i], rgfTelemetryText[i], imu, *pframe);
+            }
+
+            if (pframe->fText)
+                clients[i].send(pframe->sz, pframe->cb);
+            else
+                clients[i].sendBinary(pframe->sz, pframe->cb);
+
+            // keep to the requested rate without drifting, but don't try to catch up
+            rgUsLastSent[i] += rgUsPeriod[i];
+            if ((usNow - rgUsLastSent[i]) >= rgUsPeriod[i])
+                rgUsLastSent[i] = usNow;
         }
     }
 
@@ -172,6 +740,11 @@ namespace WebSocket
     {
         listenForClients();
         pollClients();
+        streamImu();
+        publishTelemetry();
+
+        if (fPixelsActive && (millis() - tmLastPixels) > tmPixelTimeout)
+            pixelsActivity(false);
     }
 
-}
\ No newline at end of file
+}
@@ -2,16 +2,124 @@
 #define _WEB_SOCKET_H_
 
 #include <Arduino.h>
+#include <Stats.h>
 
 //
 // Implements a websocket server
 //
+// Binary protocol
+//
+// A binary message is a one byte opcode followed by its arguments. Every
+// reply starts with the opcode of the request it answers; a request we can't
+// handle is answered with { opError, opcode }. Multi-byte fields are
+// little-endian and every layout is fixed, see the structs below.
+//
+//      opImu                           -> imu_reply_t
+//      opImuHistory    uint16_t N      -> opImuHistory, the last N Imu::record_t
+//      opImuStream     uint8_t on      -> opImuHistory, each new Imu::record_t as it arrives
+//      opRelayOpen
+//      opRelayClose
+//      opRelayStatus                   -> relay_reply_t
+//      opStats                         -> stats_reply_t
+//      opSubscribe     uint8_t hz, uint32_t topic mask
+//      opUnsubscribe
+//      opPixels        OPC messages
+//      opFrame         pixel data
+//
+// A subscriber is sent an opTelemetry message at the requested rate (up to
+// 100Hz): the topic mask, then one 4 byte value for each topic in the mask,
+// lowest bit first. Orientations are floats, everything else uint32_t.
+//
+// Pixels
+//
+// opPixels carries one or more complete Open Pixel Control messages (channel,
+// command, big-endian length, RGB data), exactly as they would be sent over
+// TCP. opFrame is a whole frame of RGB data, strip after strip, like OPC
+// channel 0. Either one is shown as a single frame and neither is answered.
+// Frames go through the same buffers as Open Pixel Control: if the strips
+// are still busy with the last one, a newer frame replaces it, so a client
+// that sends too fast just has frames dropped. A client stops counting as
+// connected 2s after its last frame. The payload is taken byte for byte,
+// zeros (black pixels) included, and its length is the message's.
+//
+// Text protocol
+//
+// The original text requests still work and are mapped onto the same
+// handlers. They are answered with text, except for the IMU history:
+//
+//      imu/history N       the last N IMU samples
+//      imu/stream/on       every new IMU sample, as it arrives
+//      imu/stream/off
+//
+// which are sent as binary messages of packed Imu::record_t, without an
+// opcode.
+//
+// Instead of polling, a client can subscribe to any of the values it could
+// ask for, plus stats/fps:
+//
+//      subscribe 30 imu/head_orientation relay/is_open
+//      unsubscribe
+//
+// and is then sent one JSON object holding all of them at the given rate
+// (up to 100Hz). A new subscribe replaces the previous one.
+//
 
 namespace WebSocket {
 
+    enum Opcode : uint8_t {
+        opImu = 0x01,
+        opImuHistory = 0x02,
+        opImuStream = 0x03,
+        opRelayOpen = 0x04,
+        opRelayClose = 0x05,
+        opRelayStatus = 0x06,
+        opStats = 0x07,
+        opSubscribe = 0x08,
+        opUnsubscribe = 0x09,
+        opTelemetry = 0x0A,                 // sent to subscribers, never a request
+        opPixels = 0x0B,
+        opFrame = 0x0C,
+        cOpcodes,
+        opError = 0x7F
+    };
+
+    // Topic mask bits, for opSubscribe
+    enum Topic {
+        topicOrientationX,
+        topicOrientationY,
+        topicOrientationZ,
+        topicHeadOrientation,
+        topicCalibrationSys,
+        topicCalibrationGyro,
+        topicCalibrationAccel,
+        topicCalibrationMag,
+        topicImuTimestamp,
+        topicRelayIsOpen,
+        topicFps,
+        cTopics
+    };
+
+    struct __attribute__((packed)) imu_reply_t {
+        uint8_t opcode;
+        uint32_t timestamp;                 // millis()
+        float orientation[3];               // heading, roll, pitch in degrees
+        float head_orientation;
+        uint8_t calibration[4];             // sys, gyro, accel, mag
+    };
+
+    struct __attribute__((packed)) relay_reply_t {
+        uint8_t opcode;
+        uint8_t is_open;
+    };
+
+    struct __attribute__((packed)) stats_reply_t {
+        uint8_t opcode;
+        Stats::second_t second;             // the last complete second
+    };
+
     void setup();
     void loop();
 
 }
 
-#endif /* _WEB_SOCKET_H_ */
\ No newline at end of file
+#endif /* _WEB_SOCKET_H_ */
@@ -13,26 +13,40 @@
 #include <Ota.h>
 #include <Imu.h>
 #include <Logger.h>
+#include <Stats.h>
+#include <Scheduler.h>
+#include <Profiler.h>
+#include <Telemetry.h>
 
 void setup() {
 
-    Logger.println("Begin");
+    LOG_INFO(SYS, "Begin");
 
     Heartbeat::setup();
     Util::setup();
+    Profiler::setup();
+    Stats::setup();
     Persist::setup();
     TcpServer::setup();
     LED::setup();
     Imu::setup();
+
+    //                name          function                period (us) priority                            slice (us)
+    Scheduler::add("pixels",    TcpServer::loopPixels,  0,          Scheduler::priorityFrame,           500);
+    Scheduler::add("led",       LED::loop,              0,          Scheduler::priorityFrame,           500);
+    Scheduler::add("network",   TcpServer::loop,        1000,       Scheduler::priorityNormal,          1000);
+    Scheduler::add("imu",       Imu::loop,              10000,      Scheduler::priorityNormal,          1000);
+    Scheduler::add("heartbeat", Heartbeat::loop,        20000,      Scheduler::priorityHousekeeping,    100);
+    Scheduler::add("stats",     Stats::loop,            100000,     Scheduler::priorityHousekeeping,    100);
+    Scheduler::add("telemetry", Telemetry::loop,        Telemetry::usInterval, Scheduler::priorityHousekeeping, 200);
+    Scheduler::add("persist",   Persist::loop,          100000,     Scheduler::priorityHousekeeping,    2000);
+    Scheduler::add("log",       []() { Logger.drain(); }, 10000,    Scheduler::priorityHousekeeping,    200);
     
-    Logger.println("BranchController Setup Complete");
+    LOG_INFO(SYS, "BranchController Setup Complete");
 }
 
 
 
 void loop() {
-    Heartbeat::loop();
-    TcpServer::loop();
-    LED::loop();
-    Imu::loop();
+    Scheduler::loop();
 }
\ No newline at end of file
@@ -0,0 +1,171 @@
+#!/usr/bin/env python3
+"""Decodes the Serial log of a firmware built with LOG_DEFERRED.
+
+Text passes through unchanged. Binary records written by LOG_PRINTF()
+(see lib/Logger/Logger.h) are looked up in the firmware's ELF file and
+formatted here instead of on the device:
+
+    0xFF, length of the rest, format address (4 bytes), arguments
+
+0x80 in the length means the arguments didn't all fit in the record.
+
+Usage:
+
+    logdecode.py .pio/build/release/firmware.elf [capture]
+
+Reads the capture from stdin if no file is given, so a serial terminal
+can be piped straight in, e.g.
+
+    cat /dev/ttyACM0 | logdecode.py .pio/build/release/firmware.elf
+
+The ELF file must be the one the device is running: format addresses
+change from build to build.
+"""
+
+import re
+import struct
+import sys
+
+RECORD_MARKER = 0xFF
+LENGTH_TRUNCATED = 0x80
+
+# printf conversions, and the arguments they consume
+CONVERSION = re.compile(r"%([-+ #0]*)(\d+|\*)?(?:\.(\d+|\*))?(hh|h|ll|l|z|j|t)?([diouxXcsfFeEgGaAp%])")
+
+
+class Elf:
+    """Just enough of an ELF reader to find strings by address."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+
+        if self.data[:4] != b"\x7fELF":
+            raise ValueError("%s is not an ELF file" % path)
+
+        is64 = self.data[4] == 2
+        endian = "<" if self.data[5] == 1 else ">"
+
+        if is64:
+            shoff, = struct.unpack_from(endian + "Q", self.data, 0x28)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x3A)
+            fmt = endian + "IIQQQQ"
+        else:
+            shoff, = struct.unpack_from(endian + "I", self.data, 0x20)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x2E)
+            fmt = endian + "IIIIII"
+
+        SHT_NOBITS = 8
+        self.sections = []
+        for i in range(shnum):
+            _, sh_type, _, addr, offset, size = struct.unpack_from(fmt, self.data, shoff + i * shentsize)
+            if addr != 0 and sh_type != SHT_NOBITS:
+                self.sections.append((addr, offset, size))
+
+    def string(self, address):
+        for addr, offset, size in self.sections:
+            if addr <= address < addr + size:
+                start = offset + address - addr
+                end = self.data.index(b"\0", start)
+                return self.data[start:end].decode("utf-8", "replace")
+        return None
+
+
+def format_record(elf, payload, truncated=False):
+    if len(payload) < 4:
+        return "<short log record>"
+
+    address, = struct.unpack_from("<I", payload, 0)
+    fmt = elf.string(address)
+    if fmt is None:
+        return "<unknown log format 0x%08x>" % address
+
+    ix = 4
+    out = []
+    last = 0
+
+    for m in CONVERSION.finditer(fmt):
+        out.append(fmt[last:m.start()])
+        last = m.end()
+
+        flags, width, precision, length, conversion = m.groups()
+        if conversion == "%":
+            out.append("%")
+            continue
+
+        try:
+            # a * width or precision is an int argument of its own
+            if width == "*":
+                width = str(struct.unpack_from("<i", payload, ix)[0])
+                ix += 4
+            if precision == "*":
+                precision = str(max(struct.unpack_from("<i", payload, ix)[0], 0))
+                ix += 4
+
+            spec = "%" + flags + (width or "") + ("." + precision if precision else "")
+
+            if conversion == "s":
+                end = payload.index(b"\0", ix)
+                value = payload[ix:end].decode("utf-8", "replace")
+                ix = end + 1
+                out.append((spec + "s") % value)
+            elif conversion in "fFeEgGaA":
+                value, = struct.unpack_from("<d", payload, ix)
+                ix += 8
+                out.append((spec + conversion.replace("a", "e").replace("A", "E")) % value)
+            else:
+                wide = length in ("ll", "j")
+                signed = conversion in "di"
+                code = ("q" if signed else "Q") if wide else ("i" if signed else "I")
+                value, = struct.unpack_from("<" + code, payload, ix)
+                ix += 8 if wide else 4
+                if conversion == "c":
+                    out.append((spec + "c") % chr(value & 0xFF))
+                elif conversion == "p":
+                    out.append("0x%08x" % value)
+                else:
+                    out.append((spec + conversion.replace("u", "d")) % value)
+        except (ValueError, TypeError, struct.error):
+            out.append("<truncated>")
+            return "".join(out)
+
+    out.append(fmt[last:])
+    if truncated:
+        out.append("<truncated>")
+    return "".join(out)
+
+
+def decode(elf, stream, out):
+    while True:
+        b = stream.read(1)
+        if not b:
+            return
+
+        if b[0] != RECORD_MARKER:
+            out.write(b.decode("latin-1"))
+            continue
+
+        length = stream.read(1)
+        if not length:
+            return
+        payload = stream.read(length[0] & ~LENGTH_TRUNCATED)
+        out.write(format_record(elf, payload, bool(length[0] & LENGTH_TRUNCATED)))
+        out.flush()
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.stderr.write(__doc__)
+        return 2
+
+    elf = Elf(sys.argv[1])
+    if len(sys.argv) == 3:
+        with open(sys.argv[2], "rb") as stream:
+            decode(elf, stream, sys.stdout)
+    else:
+        decode(elf, sys.stdin.buffer, sys.stdout)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())